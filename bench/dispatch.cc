@@ -0,0 +1,66 @@
+// Dispatch cost of the bytecode interpreter, in nanoseconds per instruction.
+// Build once as is and once with -DJIAN_SWITCH_DISPATCH to compare computed
+// goto with the switch loop.
+
+#include "../jian.h"
+
+#include <chrono>
+
+using jian::vm::Instr;
+using jian::vm::Op;
+
+int main(int argc, const char *argv[]) {
+  const size_t length = 1000;
+  const size_t calls = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+
+  jian::vm::Machine vm{false};
+  auto &fn = vm.NewFunction("bench", 0, nullptr);
+  fn.Regs = 8;
+  fn.Constants = {0, 1};
+
+  // A random mix of cheap instructions, so that the cost measured is mostly
+  // dispatch and the branch predictor cannot learn a fixed opcode sequence. r1
+  // stays true, conditional jumps fall through.
+  fn.Code.push_back({Op::Const, 1, 1, 0});
+  uint32_t seed = 42;
+  while (fn.Code.size() < length - 1) {
+    seed = seed * 1103515245u + 12345u;
+    auto dst = static_cast<uint16_t>(2 + (seed >> 8) % 6);
+    auto src = static_cast<uint16_t>(1 + (seed >> 12) % 7);
+    auto next = static_cast<uint16_t>(fn.Code.size() + 1);
+    switch ((seed >> 16) % 4) {
+    case 0:
+      fn.Code.push_back({Op::Move, dst, src, 0});
+      break;
+    case 1:
+      fn.Code.push_back({Op::Const, dst, static_cast<uint16_t>(seed & 1), 0});
+      break;
+    case 2:
+      fn.Code.push_back({Op::JumpIfNot, 1, next, 0});
+      break;
+    default:
+      fn.Code.push_back({Op::Jump, 0, next, 0});
+      break;
+    }
+  }
+  fn.Code.push_back({Op::Return, 2, 0, 0});
+  fn.Finish();
+
+  auto begin = std::chrono::steady_clock::now();
+  jian::vm::Value sum = 0;
+  for (size_t i = 0; i < calls; i++) {
+    sum += vm.Run(fn);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  auto ns = std::chrono::duration<double, std::nano>(end - begin).count();
+#ifdef JIAN_THREADED_DISPATCH
+  const char *mode = "computed goto";
+#else
+  const char *mode = "switch";
+#endif
+  printf("%s: %.3f ns/instruction (%zu instructions, checksum %lld)\n", mode,
+         ns / static_cast<double>(length * calls), length * calls,
+         static_cast<long long>(sum));
+  return 0;
+}
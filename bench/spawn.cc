@@ -0,0 +1,107 @@
+// Launch cost of the shell runtime, in microseconds per command. The heap is
+// grown first, since copying it on every launch is what spawning avoids. Then
+// short sleeps, one after another and through the scheduler, show how much
+// waiting overlaps. Last, jian parallel's exit statuses and job limit are
+// checked, failing the run if they are wrong.
+
+#include "../jian.h"
+
+#include <chrono>
+#include <sstream>
+
+using jian::shell::Command;
+using jian::shell::Pipeline;
+using jian::shell::Scheduler;
+
+template <typename F> static double perRun(size_t runs, F &&f) {
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < runs; i++) {
+    f();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - begin).count() /
+         static_cast<double>(runs);
+}
+
+int main(int argc, const char *argv[]) {
+  const size_t runs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+  const size_t heap = argc > 2 ? strtoul(argv[2], nullptr, 10) : 256;
+
+  std::vector<std::unique_ptr<char[]>> ballast{};
+  for (size_t i = 0; i < heap; i++) {
+    ballast.emplace_back(new char[1 << 20]);
+    memset(ballast.back().get(), 1, 1 << 20);
+  }
+
+  const Command yes{"true"};
+  auto single = perRun(runs, [&] {
+    Pipeline p{};
+    p.Start({yes});
+    p.Wait();
+  });
+
+  const std::vector<Command> pipeline{{"echo", "jian"}, {"cat"}, {"cat"}};
+  size_t bytes = 0;
+  auto captured = perRun(runs, [&] {
+    Pipeline p{};
+    p.Start(pipeline, STDIN_FILENO, -1);
+    p.Wait();
+    bytes += p.Output ? p.Output->View().size() : 0;
+  });
+
+  printf("%zu MB heap: %.1f us/command, %.1f us/3-command capture "
+         "(%zu bytes captured)\n",
+         heap, single, captured / 3, bytes);
+
+  const size_t naps = std::max<size_t>(runs / 10, 1), limit = 16;
+  const std::vector<Command> nap{{"sleep", "0.01"}};
+  auto serial = perRun(naps, [&] {
+    Pipeline p{};
+    p.Start(nap);
+    p.Wait();
+  });
+  auto parallel = perRun(1, [&] {
+    Scheduler s{limit};
+    for (size_t i = 0; i < naps; i++) {
+      s.Add(nap);
+    }
+    s.Run();
+  });
+  printf("%zu sleeps of 10 ms: %.1f us each in turn, "
+         "%.1f us each %zu at once\n",
+         naps, serial, parallel / static_cast<double>(naps), limit);
+
+  int failures = 0;
+  auto check = [&](bool ok, const char *what) {
+    if (!ok) {
+      fprintf(stderr, "spawn check failed: %s\n", what);
+      failures++;
+    }
+  };
+  const std::vector<std::pair<std::vector<Command>, int>> statuses{
+      {{{"true"}}, 0},
+      {{{"false"}}, 1},
+      {{{"sh", "-c", "exit 3"}}, 3},
+      {{{"sh", "-c", "kill -9 $$"}}, 128 + SIGKILL},
+      {{{"jian-no-such-command"}}, 127},
+      {{{"false"}, {"true"}}, 0},
+  };
+  Scheduler s{2};
+  for (auto &[cmds, status] : statuses) {
+    s.Add(cmds);
+  }
+  s.Run();
+  for (size_t i = 0; i < statuses.size(); i++) {
+    check(s[i].Status() == statuses[i].second, "job status");
+  }
+
+  // Four 50 ms sleeps two at a time take two rounds.
+  auto limited = perRun(1, [&] {
+    std::istringstream in{"sleep 0.05\nsleep 0.05\nsleep 0.05\nsleep 0.05\n"};
+    check(jian::Driver::RunParallel(in, 2) == 0, "parallel exit status");
+  });
+  check(limited >= 100000, "parallel job limit");
+  std::istringstream failing{"true\nfalse\n\njian-no-such-command\n"};
+  check(jian::Driver::RunParallel(failing, 2) == 2, "parallel failure count");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,339 @@
+// Every stage on generated programs: lexing and parsing throughput, resolving
+// and checking many definitions or deeply nested ones, gccjit compile latency,
+// bytecode against compiled execution, and the collector. Each result is the
+// best of a few runs, printed as one line of name, value and unit, so that
+// the output of two commits can be diffed or joined. The first argument
+// scales every workload.
+
+#include "../jian.h"
+
+#include <chrono>
+
+using namespace jian;
+
+static constexpr size_t Repeats = 5;
+
+template <typename F> static double seconds(F &&f) {
+  auto begin = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+// The least of the times run returns, which measures its own interval so
+// that setup is left out.
+template <typename F> static double best(F &&run) {
+  auto least = run();
+  for (size_t i = 1; i < Repeats; i++) {
+    least = std::min(least, run());
+  }
+  return least;
+}
+
+static void report(const char *name, double value, const char *unit) {
+  printf("%-24s %14.3f %s\n", name, value, unit);
+}
+
+// Definitions are named by lowercase letters only.
+static std::string name(size_t i) {
+  std::string s{"f"};
+  do {
+    s += static_cast<char>('a' + i % 26);
+    i /= 26;
+  } while (i);
+  return s;
+}
+
+// Each definition calls the one before, through a call, a conditional or a
+// lambda in turn.
+static std::string wide(size_t defs) {
+  std::string s{"id(x) x\nkk(a, b) a\n"}, prev{"id"};
+  for (size_t i = 0; i < defs; i++) {
+    auto f = name(i);
+    switch (i % 3) {
+    case 0:
+      s += f + "(x) kk(" + prev + "(x), id(x))\n";
+      break;
+    case 1:
+      s += f + "(x) if true then " + prev + "(x) else x\n";
+      break;
+    default:
+      s += f + "(x) ((y) => " + prev + "(y))(x)\n";
+      break;
+    }
+    prev = f;
+  }
+  return s + "main() " + prev + "(42)\n";
+}
+
+// Lambdas inside lambdas, every one applied, depth levels down.
+static std::string deep(size_t depth) {
+  std::string s{"main() "};
+  for (size_t i = 0; i < depth; i++) {
+    s += "((y) => ";
+  }
+  s += "y";
+  for (size_t i = 0; i < depth; i++) {
+    s += ")(1)";
+  }
+  return s + "\n";
+}
+
+// Every level calls the one below twice, 2^levels calls in all.
+static std::string hot(size_t levels) {
+  std::string s{"id(x) x\nkk(a, b) a\n"}, prev{"id"};
+  for (size_t i = 0; i < levels; i++) {
+    auto f = name(i);
+    s += f + "(x) kk(" + prev + "(x), " + prev + "(x))\n";
+    prev = f;
+  }
+  return s + "main() " + prev + "(42)\n";
+}
+
+// One program as the driver takes a single module through the front end.
+struct Front {
+  parsing::IDs IDs{};
+  parsing::Symbols Symbols{};
+  Arena Nodes{}, Terms{};
+  elab::Table Table{};
+  parsing::Source Src;
+  parsing::Program Program{};
+  elab::Elab Elab{Terms, IDs, Table};
+  std::vector<elab::Definition> Defs{};
+
+  explicit Front(std::string_view text) : Src{text, IDs, Symbols, Nodes} {}
+
+  bool Parse() { return !parsing::ParseProgram(Program, Src).Failed; }
+
+  bool Resolve() {
+    resolving::Globals globals{};
+    for (auto &d : Program.Defs) {
+      globals.Add(Symbols.Name(d.Sym), d.ID, 0);
+    }
+    resolving::Resolver resolver{Symbols, &globals, 0};
+    resolver.Program(Program);
+    return resolver.State == resolving::Resolution::OK;
+  }
+
+  bool Check() {
+    Elab.Module(Src);
+    for (auto &d : Program.Defs) {
+      Elab.Declare(d);
+    }
+    for (auto &d : Program.Defs) {
+      auto def = Elab.Define(d);
+      def.Name = Symbols.Name(d.Sym);
+      if (Elab.State.Kind != elab::ElabStateKind::OK) {
+        return false;
+      }
+      Defs.push_back(def);
+    }
+    return true;
+  }
+
+  // Ready for code generation.
+  static std::unique_ptr<Front> Checked(std::string_view text) {
+    auto f = std::make_unique<Front>(text);
+    if (!f->Parse() || !f->Resolve() || !f->Check()) {
+      panic("generated program does not check");
+    }
+    return f;
+  }
+};
+
+static void frontEnd(size_t scale) {
+  auto text = wide(20000 * scale);
+  auto mb = static_cast<double>(text.size()) / 1e6;
+  // Printed, so that the tokens are used and the scan cannot be elided.
+  size_t checksum = 0;
+  report("lex", mb / best([&] {
+           return seconds([&] {
+             for (auto &t : parsing::Lexer::Scan(text)) {
+               checksum += t.Length + static_cast<size_t>(t.Kind);
+             }
+           });
+         }),
+         "MB/s");
+  report("lex_checksum", static_cast<double>(checksum), "sum");
+  report("parse", mb / best([&] {
+           Front f{text};
+           return seconds([&] { f.Parse(); });
+         }),
+         "MB/s");
+
+  auto defs = static_cast<double>(20000 * scale);
+  report("resolve_wide", 1e9 / defs * best([&] {
+           Front f{text};
+           f.Parse();
+           return seconds([&] { f.Resolve(); });
+         }),
+         "ns/def");
+  report("check_wide", 1e9 / defs * best([&] {
+           Front f{text};
+           f.Parse();
+           f.Resolve();
+           return seconds([&] { f.Check(); });
+         }),
+         "ns/def");
+
+  auto depth = 500 * scale;
+  auto nested = deep(depth);
+  auto levels = static_cast<double>(depth);
+  report("parse_deep", 1e9 / levels * best([&] {
+           Front f{nested};
+           return seconds([&] { f.Parse(); });
+         }),
+         "ns/level");
+  report("resolve_deep", 1e9 / levels * best([&] {
+           Front f{nested};
+           f.Parse();
+           return seconds([&] { f.Resolve(); });
+         }),
+         "ns/level");
+  report("check_deep", 1e9 / levels * best([&] {
+           Front f{nested};
+           f.Parse();
+           f.Resolve();
+           return seconds([&] { f.Check(); });
+         }),
+         "ns/level");
+}
+
+static void compileLatency(size_t scale) {
+  auto text = wide(200 * scale);
+  auto functions = static_cast<double>(200 * scale + 3);
+  for (int level : {0, 2}) {
+    std::string error{};
+    auto took = best([&] {
+      auto f = Front::Checked(text);
+      codegen::JIT jit{f->Elab, level};
+      return seconds([&] {
+        for (auto &d : f->Defs) {
+          jit.Declare(d);
+        }
+        for (auto &d : f->Defs) {
+          jit.Define(d);
+        }
+        if (!jit.Build() || !jit.Compile()) {
+          error = jit.Error;
+        }
+      });
+    });
+    if (!error.empty()) {
+      fprintf(stderr, "gccjit: %s\n", error.c_str());
+      return;
+    }
+    report(level ? "gccjit_compile_O2" : "gccjit_compile_O0",
+           1e6 / functions * took, "us/function");
+  }
+}
+
+static void execution(size_t scale) {
+  size_t levels = 18;
+  for (auto s = scale; s > 1; s /= 2) {
+    levels++;
+  }
+  auto text = hot(levels);
+  auto calls = static_cast<double>(size_t{1} << levels);
+  for (bool jit : {false, true}) {
+    auto took = best([&] {
+      auto f = Front::Checked(text);
+      vm::Machine machine{jit};
+      vm::Assembler assembler{machine, f->Elab};
+      for (auto &d : f->Defs) {
+        assembler.Declare(d);
+      }
+      for (auto &d : f->Defs) {
+        assembler.Define(d);
+      }
+      auto &start = assembler.Start(f->Defs);
+      return seconds([&] { machine.Run(start); });
+    });
+    report(jit ? "run_tiered" : "run_bytecode", 1e9 / calls * took, "ns/call");
+  }
+
+  std::string error{};
+  auto took = best([&] {
+    auto f = Front::Checked(text);
+    codegen::JIT jit{f->Elab, 2};
+    for (auto &d : f->Defs) {
+      jit.Declare(d);
+    }
+    for (auto &d : f->Defs) {
+      jit.Define(d);
+    }
+    if (!jit.Build() || !jit.Compile()) {
+      error = jit.Error;
+      return 0.0;
+    }
+    return seconds([&] { jit.Run(); });
+  });
+  if (!error.empty()) {
+    fprintf(stderr, "gccjit: %s\n", error.c_str());
+    return;
+  }
+  report("run_compiled", 1e9 / calls * took, "ns/call");
+}
+
+// Cons cells: a value and the next cell.
+static const uint32_t Next[] = {1};
+static const gc::Layout Cell{{Next, 1}};
+
+static void collector(size_t scale) {
+  const size_t churn = 4000000 * scale, live = 1000000 * scale;
+
+  // Short lives: a list that is dropped every thousand cells. The slowest
+  // single allocation is the longest minor collection.
+  gc::Value head = 0;
+  auto churning = [&](bool each) {
+    gc::Heap heap{};
+    heap.AddRoot(&head);
+    double longest = 0;
+    auto t = seconds([&] {
+      for (size_t i = 0; i < churn; i++) {
+        gc::Object *o{};
+        if (each) {
+          auto took = seconds([&] { o = heap.Allocate(Cell, 2); });
+          longest = std::max(longest, took);
+        } else {
+          o = heap.Allocate(Cell, 2);
+        }
+        o->Fields()[0] = static_cast<gc::Value>(i);
+        o->Fields()[1] = i % 1000 ? head : 0;
+        head = gc::value(o);
+      }
+    });
+    head = 0;
+    return each ? longest : t;
+  };
+  auto objects = static_cast<double>(churn);
+  report("gc_allocate", 1e9 / objects * best([&] { return churning(false); }),
+         "ns/object");
+  report("gc_minor_pause", 1e6 * best([&] { return churning(true); }), "us");
+
+  // A long list all live, collected in full.
+  auto took = best([&] {
+    gc::Heap heap{};
+    heap.AddRoot(&head);
+    for (size_t i = 0; i < live; i++) {
+      auto o = heap.Allocate(Cell, 2);
+      o->Fields()[0] = static_cast<gc::Value>(i);
+      o->Fields()[1] = head;
+      head = gc::value(o);
+    }
+    auto t = seconds([&] { heap.Collect(); });
+    head = 0;
+    return t;
+  });
+  report("gc_full_pause", 1e3 * took, "ms");
+}
+
+int main(int argc, const char *argv[]) {
+  const size_t scale =
+      std::max<size_t>(argc > 1 ? strtoul(argv[1], nullptr, 10) : 1, 1);
+  frontEnd(scale);
+  compileLatency(scale);
+  execution(scale);
+  collector(scale);
+  return 0;
+}
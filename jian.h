@@ -1,14 +1,65 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <functional>
+#include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <variant>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <link.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
+// Not declared by every unistd.h.
+extern char **environ;
 
 #include <libgccjit++.h>
 
+// Computed goto is a GNU extension that both gcc and clang support. Defining
+// JIAN_SWITCH_DISPATCH selects the portable switch loop instead.
+#if defined(__GNUC__) && !defined(JIAN_SWITCH_DISPATCH)
+#define JIAN_THREADED_DISPATCH
+#endif
+
 inline constexpr auto JIAN_VERSION_MAJOR = 0;
 inline constexpr auto JIAN_VERSION_MINOR = 1;
 inline constexpr auto JIAN_VERSION_PATCH = 0;
@@ -81,1356 +132,7160 @@ inline static void *reallocate(void *p, size_t size) {
 #define new(type) allocate(sizeof(type))
 #define make(type, count) allocateZeroed(sizeof(type), count)
 
-inline static int max(int a, int b) { return a > b ? a : b; }
+enum ThmKind { Thm_Undefined = 1 };
 
+struct Thm {
+  struct node AsNode;
 
-struct node {
-  struct node *Left, *Right;
-  int Key, Height;
+  enum ThmKind Kind;
 };
 
-inline static void node_Default(struct node *node) {
-  node->Left = NULL;
-  node->Right = NULL;
-  node->Height = 1;
-}
+*/
 
-inline static int node_height(struct node *node) { return !node ? 0 :
-node->Height; }
-
-inline static struct node *node_rightRotate(struct node *x) {
-  struct node *y = x->Left;
-  struct node *z = y->Right;
-  y->Right = x;
-  x->Left = z;
-  x->Height = max(node_height(x->Left), node_height(x->Right)) + 1;
-  y->Height = max(node_height(y->Left), node_height(y->Right)) + 1;
-  return y;
-}
+namespace jian {
 
-inline static struct node *node_leftRotate(struct node *x) {
-  struct node *y = x->Right;
-  struct node *z = y->Left;
-  y->Left = x;
-  x->Right = z;
-  x->Height = max(node_height(x->Left), node_height(x->Right)) + 1;
-  y->Height = max(node_height(y->Left), node_height(y->Right)) + 1;
-  return y;
-}
+class Error {
+  [[maybe_unused]] const char *Msg;
 
-inline static int node_balance(struct node *node) {
-  return !node ? 0 : node_height(node->Left) - node_height(node->Right);
-}
+public:
+  explicit Error(const char *msg) : Msg{msg} {}
+};
 
-inline static struct node *tree_Insert(struct node *root, struct node *other) {
-  if (!root) {
-    return other;
-  }
+template <typename T> using Result = std::variant<T, Error>;
 
-  if (other->Key < root->Key) {
-    root->Left = tree_Insert(root->Left, other);
-  } else if (other->Key > root->Key) {
-    root->Right = tree_Insert(root->Right, other);
-  } else {
-    return root;
+// Bump allocator owning everything one compilation creates: AST nodes,
+// resolver and elaborator data. Objects are never destroyed one by one, so
+// only trivially destructible types may live here. A checkpoint taken before
+// a speculative parse can be rolled back to drop whatever it built.
+class Arena {
+  struct Chunk {
+    Chunk *Prev;
+    char *End;
+  };
+
+  static constexpr size_t ChunkSize = 64 * 1024;
+
+  Chunk *Head{};
+  char *Ptr{}, *End{};
+
+  void grow(size_t size) {
+    auto cap = std::max(ChunkSize, sizeof(Chunk) + size);
+    auto c = static_cast<Chunk *>(malloc(cap));
+    if (!c) {
+      panic("out of memory");
+    }
+    c->Prev = Head;
+    c->End = reinterpret_cast<char *>(c) + cap;
+    Head = c;
+    Ptr = reinterpret_cast<char *>(c + 1);
+    End = c->End;
   }
 
-  root->Height = max(node_height(root->Left), node_height(root->Right)) + 1;
-
-  int balance = node_balance(root);
-  if (balance > 1 && other->Key < root->Left->Key) {
-    return node_rightRotate(root);
-  }
-  if (balance < -1 && other->Key > root->Right->Key) {
-    return node_leftRotate(root);
-  }
-  if (balance > 1 && other->Key > root->Left->Key) {
-    root->Left = node_leftRotate(root->Left);
-    return node_rightRotate(root);
-  }
-  if (balance < -1 && other->Key < root->Right->Key) {
-    root->Right = node_rightRotate(root->Right);
-    return node_leftRotate(root);
+public:
+  struct Mark {
+    Chunk *Head;
+    char *Ptr;
+  };
+
+  // Objects and arrays handed out, rolled back or not.
+  size_t Allocations{};
+
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() { Rollback({}); }
+
+  void *Allocate(size_t size, size_t align) {
+    if (Head) {
+      auto addr = reinterpret_cast<uintptr_t>(Ptr);
+      auto pad = (align - addr % align) % align;
+      if (pad + size <= static_cast<size_t>(End - Ptr)) {
+        auto p = Ptr + pad;
+        Ptr = p + size;
+        Allocations++;
+        return p;
+      }
+    }
+    grow(size + align);
+    return Allocate(size, align);
   }
 
-  return root;
-}
-
-inline static void tree_Iter(void *data, struct node *root,
-                      void (*f)(void *data, struct node *node)) {
-  if (!root) {
-    return;
+  template <typename T, typename... Args> T *New(Args &&...args) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    return new (Allocate(sizeof(T), alignof(T))) T{std::forward<Args>(args)...};
   }
-  tree_Iter(data, root->Left, f);
-  f(data, root);
-  tree_Iter(data, root->Right, f);
-}
 
-inline static void tree_Free(struct node *root,
-                          void *(*downcast)(struct node *node)) {
-  if (!root) {
-    return;
+  template <typename T> T *NewArray(size_t n) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    auto p = static_cast<T *>(Allocate(sizeof(T) * n, alignof(T)));
+    for (size_t i = 0; i < n; i++) {
+      new (p + i) T{};
+    }
+    return p;
   }
-  tree_Free(root->Left, downcast);
-  tree_Free(root->Right, downcast);
-  free(downcast(root));
-}
-
-struct slice {
-  uint8_t *Data;
-  size_t ElemSize, Size, Cap;
-};
-
-inline static void slice_Init(struct slice *s, size_t elemSize) {
-  s->ElemSize = elemSize;
-  s->Size = 0;
-  s->Cap = 4;
-  s->Data = allocateZeroed(elemSize, s->Cap);
-}
 
-inline static void slice_Append(struct slice *s, void *value) {
-  if (s->Size == s->Cap) {
-    s->Cap *= 2;
-    s->Data = reallocate(s->Data, s->Cap * s->ElemSize);
-  }
-  memcpy(s->Data + s->Size * s->ElemSize, value, s->ElemSize);
-  s->Size++;
-}
+  Mark Checkpoint() const { return {Head, Ptr}; }
 
-inline static void slice_Iter(void *data, struct slice *s,
-                       void (*f)(void *data, void *elem)) {
-  uint8_t *elem = s->Data;
-  for (size_t i = 0; i < s->Size; i++, elem += s->ElemSize) {
-    f(data, elem);
+  void Rollback(Mark m) {
+    while (Head != m.Head) {
+      auto prev = Head->Prev;
+      free(Head);
+      Head = prev;
+    }
+    Ptr = m.Ptr;
+    End = Head ? Head->End : nullptr;
   }
-}
+};
 
-inline static void slice_Free(struct slice *s) {
-  free(s->Data);
-  s->Data = NULL;
-  s->Size = 0;
-  s->Cap = 0;
-}
+// Contiguous run of arena-allocated elements.
+template <typename T> struct Slice {
+  T *Data{};
+  size_t Size{};
 
-struct entry {
-  struct entry *Next;
-  const char *Key;
-  int Val;
-};
+  template <typename C> static Slice<T> From(Arena &arena, const C &xs) {
+    Slice<T> s{arena.NewArray<T>(xs.size()), xs.size()};
+    std::copy(xs.begin(), xs.end(), s.Data);
+    return s;
+  }
 
-struct map {
-  struct entry **Buckets;
-  size_t Size, Cap;
+  T *begin() const { return Data; }
+  T *end() const { return Data + Size; }
+  T &operator[](size_t i) const { return Data[i]; }
 };
 
-inline static void map_Default(struct map *m) {
-  m->Size = 0;
-  m->Cap = 8;
-  m->Buckets = make(struct entry *, m->Cap);
-}
+// Vector keeping its first N elements inline, for short lists that are built
+// on the stack and then copied into the arena, like parameter lists.
+template <typename T, size_t N> class SmallVector {
+  static_assert(std::is_trivially_copyable_v<T>);
 
-inline static size_t map_hash(const char *key, size_t cap) {
-  size_t h = 0;
-  for (char c = *key; c != '\0'; c++) {
-    h = h * 31 + (size_t)c;
-  }
-  return h % cap;
-}
+  T Inline[N];
+  T *Data{Inline};
+  size_t Size{}, Cap{N};
 
-inline static void map_rehash(struct map *m) {
-  size_t newCap = m->Cap * 2;
-  struct entry **newBuckets = make(struct entry *, newCap);
+public:
+  SmallVector() = default;
+  SmallVector(const SmallVector &) = delete;
+  SmallVector &operator=(const SmallVector &) = delete;
 
-  for (size_t i = 0; i < m->Cap; i++) {
-    struct entry *e = m->Buckets[i];
-    while (e) {
-      struct entry *Next = e->Next;
-      size_t index = map_hash(e->Key, newCap);
-      e->Next = newBuckets[index];
-      newBuckets[index] = e;
-      e = Next;
+  ~SmallVector() {
+    if (Data != Inline) {
+      free(Data);
     }
   }
 
-  free(m->Buckets);
-  m->Buckets = newBuckets;
-  m->Cap = newCap;
-}
-
-inline static bool map_Set(struct map *m, const char *key, int val) {
-  if ((double)m->Size / (double)m->Cap >= 1.0) {
-    map_rehash(m);
-  }
-  size_t index = map_hash(key, m->Cap);
-  struct entry *e = m->Buckets[index];
-  while (e) {
-    if (strcmp(e->Key, key) == 0) {
-      e->Val = val;
-      return true;
+  void push_back(const T &x) {
+    if (Size == Cap) {
+      Cap *= 2;
+      auto data = static_cast<T *>(malloc(Cap * sizeof(T)));
+      if (!data) {
+        panic("out of memory");
+      }
+      std::copy(Data, Data + Size, data);
+      if (Data != Inline) {
+        free(Data);
+      }
+      Data = data;
     }
-    e = e->Next;
+    Data[Size++] = x;
   }
-  e = new (struct entry);
-  e->Key = key;
-  e->Val = val;
-  e->Next = m->Buckets[index];
-  m->Buckets[index] = e;
-  m->Size++;
-  return false;
+
+  size_t size() const { return Size; }
+  const T *begin() const { return Data; }
+  const T *end() const { return Data + Size; }
+};
+
+// Starts a helper thread with SIGPROF blocked, which it inherits, so that a
+// profiler's timer only ever interrupts the thread running the program.
+template <typename F> static inline std::thread Spawn(F &&f) {
+  sigset_t profiling, old;
+  sigemptyset(&profiling);
+  sigaddset(&profiling, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &profiling, &old);
+  std::thread t{std::forward<F>(f)};
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  return t;
 }
 
-inline static bool map_Get(struct map *m, const char *key, int *val) {
-  size_t index = map_hash(key, m->Cap);
-  struct entry *e = m->Buckets[index];
-  while (e) {
-    if (strcmp(e->Key, key) == 0) {
-      *val = e->Val;
+// Work-stealing thread pool. Every worker owns a task deque: it runs its own
+// newest task first and, once empty, steals the oldest task of another worker.
+class Pool {
+  struct Worker {
+    std::mutex Lock{};
+    std::deque<std::function<void()>> Tasks{};
+  };
+
+  std::vector<std::unique_ptr<Worker>> Workers{};
+  std::vector<std::thread> Threads{};
+  std::mutex Lock{};
+  std::condition_variable Ready{}, Done{};
+  std::atomic<size_t> Queued{}, Pending{}, NextWorker{};
+  bool Stopping{};
+
+  bool take(size_t self, std::function<void()> &task) {
+    for (size_t i = 0; i < Workers.size(); i++) {
+      auto &w = *Workers[(self + i) % Workers.size()];
+      std::lock_guard<std::mutex> l{w.Lock};
+      if (w.Tasks.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        task = std::move(w.Tasks.back());
+        w.Tasks.pop_back();
+      } else {
+        task = std::move(w.Tasks.front());
+        w.Tasks.pop_front();
+      }
+      Queued--;
       return true;
     }
-    e = e->Next;
+    return false;
   }
-  return false;
-}
 
-inline static void map_Free(struct map *m) {
-  for (size_t i = 0; i < m->Cap; i++) {
-    struct entry *e = m->Buckets[i];
-    while (e) {
-      struct entry *Next = e->Next;
-      if (e->Key) {
-        free((void *)e->Key);
+  void run(size_t self) {
+    while (true) {
+      std::function<void()> task;
+      if (take(self, task)) {
+        task();
+        if (--Pending == 0) {
+          std::lock_guard<std::mutex> l{Lock};
+          Done.notify_all();
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> l{Lock};
+      Ready.wait(l, [&] { return Stopping || Queued > 0; });
+      if (Stopping && Queued == 0) {
+        return;
       }
-      free(e);
-      e = Next;
     }
   }
-  free(m->Buckets);
-  m->Buckets = NULL;
-}
 
-inline static void map_Merge(struct map *lhs, struct map *rhs) {
-  for (size_t i = 0; i < rhs->Cap; i++) {
-    struct entry *rhs_e = rhs->Buckets[i];
-    while (rhs_e) {
-      struct entry *rhs_next = rhs_e->Next;
-      if (map_Set(lhs, rhs_e->Key, rhs_e->Val)) {
-        free((void *)rhs_e->Key);
-      }
-      rhs_e->Key = NULL;
-      rhs_e = rhs_next;
+public:
+  explicit Pool(size_t n) {
+    n = std::max<size_t>(n, 1);
+    for (size_t i = 0; i < n; i++) {
+      Workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < n; i++) {
+      Threads.push_back(Spawn([this, i] { run(i); }));
     }
   }
-  map_Free(rhs);
-}
-
-enum objectKind { object_Num = 1 };
 
-struct object {
-  enum objectKind Kind;
-  bool Marked;
-  struct object *Next;
-};
-
-inline static void object_Init(struct object *o, enum objectKind kind,
-                        struct object *Next) {
-  o->Kind = kind;
-  o->Marked = 0;
-  o->Next = Next;
-}
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
 
-inline static void object_Mark(struct object *o) {
-  if (o->Marked) {
-    return;
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> l{Lock};
+      Stopping = true;
+    }
+    Ready.notify_all();
+    for (auto &t : Threads) {
+      t.join();
+    }
   }
-  o->Marked = 1;
-  // TODO: Mark other objects from the members.
-}
-
-struct gc {
-  struct object *Stack[256];
-  size_t StackSize, Reachable, Max;
-  struct object *Root;
-};
-
-inline static void gc_Default(struct gc *c) {
-  c->StackSize = 0;
-  c->Reachable = 0;
-  c->Max = 8;
-  c->Root = NULL;
-}
 
-inline static void gc_Push(struct gc *gc, struct object *value) {
-  if (gc->StackSize >= sizeof(gc->Stack) / sizeof(struct object *)) {
-    printf("Stack overflow\n");
-    exit(1);
+  static size_t Cores() {
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
   }
-  gc->Stack[gc->StackSize] = value;
-  gc->StackSize++;
-}
 
-inline static struct object *gc_Pop(struct gc *gc) {
-  if (gc->StackSize <= 0) {
-    printf("Stack overflow\n");
-    exit(1);
+  void Submit(std::function<void()> task) {
+    auto &w = *Workers[NextWorker++ % Workers.size()];
+    Pending++;
+    {
+      std::lock_guard<std::mutex> l{w.Lock};
+      w.Tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> l{Lock};
+      Queued++;
+    }
+    Ready.notify_one();
   }
-  struct object *ret = gc->Stack[gc->StackSize];
-  gc->StackSize--;
-  return ret;
-}
 
-inline static void gc_Mark(struct gc *vm) {
-  for (size_t i = 0; i < vm->StackSize; i++) {
-    object_Mark(vm->Stack[i]);
+  // Blocks until every submitted task has finished.
+  void Wait() {
+    std::unique_lock<std::mutex> l{Lock};
+    Done.wait(l, [&] { return Pending == 0; });
   }
-}
+};
 
-inline static void gc_Sweep(struct gc *vm) {
-  struct object **object = &vm->Root;
-  while (*object) {
-    if ((*object)->Marked) {
-      (*object)->Marked = 0;
-      object = &(*object)->Next;
-      continue;
-    }
-    struct object *unreached = *object;
-    *object = unreached->Next;
-    free(unreached);
-    vm->Reachable--;
-  }
-}
+namespace parsing {
 
-inline static void gc_Run(struct gc *vm) {
-  gc_Mark(vm);
-  gc_Sweep(vm);
-  vm->Max = vm->Reachable == 0 ? 8 : vm->Reachable * 2;
-}
+// Source of node identity shared by every front end of a compilation. IDs are
+// positive, and safe to draw from any number of threads.
+class IDs {
+  std::atomic<int> Next{};
+
+public:
+  int New() { return Reserve(1); }
 
-inline static struct object *gc_NewObject(struct gc *vm, enum objectKind kind) {
-  if (vm->Reachable == vm->Max) {
-    gc_Run(vm);
+  // Reserves n consecutive IDs and returns the first one.
+  int Reserve(int n) {
+    return Next.fetch_add(n, std::memory_order_relaxed) + 1;
   }
-  struct object *o = new (struct object);
-  object_Init(o, kind, vm->Root);
-  vm->Root = o;
-  vm->Reachable++;
-  return o;
-}
+};
 
-inline static void gc_Free(struct gc *vm) {
-  vm->StackSize = 0;
-  gc_Run(vm);
-}
+// Hands out IDs from blocks reserved in bulk, so that a front end running on
+// one thread only touches the shared counter once per block.
+class IDBlock {
+  static constexpr int Size = 1024;
 
+  IDs &Pool;
+  int Cur{}, End{};
 
-struct Parser;
-struct Expr;
-struct Def;
+public:
+  explicit IDBlock(IDs &pool) : Pool{pool} {}
 
-struct Range {
-  char From, To;
+  int New() {
+    if (Cur == End) {
+      Cur = Pool.Reserve(Size);
+      End = Cur + Size;
+    }
+    return Cur++;
+  }
 };
 
-union ParserCtx {
-  const char *Word;
-  struct Range Range;
-  struct Parser *Parser;
-  struct Parser **Parsers;
-
-  struct span *Span;
-  struct slice *Slice;
-  struct node **Nodes;
-  struct Expr *Expr;
-  struct Def *Def;
+struct Loc {
+  size_t Pos{}, Ln{1}, Col{1};
 };
 
-struct Parser {
-  struct Source *(*Parse)(union ParserCtx *ctx, struct Source *s);
-  union ParserCtx Ctx;
+// Byte offsets into the input, converted to a Loc only for diagnostics.
+struct Span {
+  size_t Start{}, End{};
 };
 
-inline static struct Source *soi(union ParserCtx *ctx, struct Source *s) {
-  (void)ctx;
-  if (s->Loc.Pos != 0) {
-    s->Failed = true;
-  }
-  return s;
-}
-
-inline static struct Source *eoi(union ParserCtx *ctx, struct Source *s) {
-  (void)ctx;
-  if (s->Loc.Pos != source_Size(s)) {
-    s->Failed = true;
-  }
-  return s;
-}
+using Symbol = uint32_t;
 
-static struct Parser Soi = {.Parse = soi};
-static struct Parser Eoi = {.Parse = eoi};
+// Interns identifiers into dense symbols, so that later phases compare and
+// index names by integer. Open addressing with linear probing over a
+// power-of-two table; names are views into the source buffer.
+class Symbols {
+  std::vector<std::string_view> Names{};
+  std::vector<uint32_t> Hashes{};
+  std::vector<uint32_t> Slots; // 0 means empty, otherwise symbol + 1.
 
-inline static struct Source *parseAtom(struct Parser *parser, struct Source *s)
-{ int atom = s->Atom; s->Atom = true; s = parser->Parse(&parser->Ctx, s);
-  s->Atom = atom;
-  return s;
-}
+  static uint32_t hash(std::string_view name) {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+      h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return h;
+  }
 
-inline static struct Source *word(union ParserCtx *ctx, struct Source *s) {
-  const char *word = ctx->Word;
-  size_t i = 0;
-  for (char c = word[i]; c != '\0'; i++, c = word[i]) {
-    s = source_Eat(s, c);
-    if (s->Failed) {
-      break;
+  void grow() {
+    std::vector<uint32_t> slots(Slots.size() * 2);
+    auto mask = slots.size() - 1;
+    for (size_t sym = 0; sym < Names.size(); sym++) {
+      auto i = Hashes[sym] & mask;
+      while (slots[i]) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = static_cast<uint32_t>(sym + 1);
     }
+    Slots.swap(slots);
   }
-  return s;
-}
 
-static struct Parser LParen = {word, {.Word = "("}};
-static struct Parser RParen = {word, {.Word = ")"}};
-static struct Parser Comma = {word, {.Word = ","}};
-static struct Parser Under = {word, {.Word = "_"}};
-static struct Parser Newline = {word, {.Word = "\n"}};
-static struct Parser Semicolon = {word, {.Word = ";"}};
-static struct Parser Assign = {word, {.Word = "="}};
-static struct Parser If = {word, {.Word = "if"}};
-static struct Parser Then = {word, {.Word = "then"}};
-static struct Parser Else = {word, {.Word = "else"}};
-static struct Parser Arrow = {word, {.Word = "=>"}};
-static struct Parser Unit = {word, {.Word = "()"}};
-static struct Parser False = {word, {.Word = "false"}};
-static struct Parser True = {word, {.Word = "true"}};
-
-inline static struct Source *range(union ParserCtx *ctx, struct Source *s) {
-  char from = ctx->Range.From, to = ctx->Range.To;
-  char c = source_Peek(s);
-  if (c < from || c > to) {
-    s->Failed = true;
-    return s;
+public:
+  // Slots looked at by Intern, for --stats.
+  size_t Probes{};
+
+  Symbols() : Slots(64) {}
+
+  Symbol Intern(std::string_view name) {
+    auto h = hash(name);
+    auto mask = Slots.size() - 1;
+    auto i = h & mask;
+    for (; ++Probes, Slots[i]; i = (i + 1) & mask) {
+      auto sym = Slots[i] - 1;
+      if (Hashes[sym] == h && Names[sym] == name) {
+        return sym;
+      }
+    }
+    auto sym = static_cast<Symbol>(Names.size());
+    Names.push_back(name);
+    Hashes.push_back(h);
+    Slots[i] = sym + 1;
+    if (Names.size() * 2 > Slots.size()) {
+      grow();
+    }
+    return sym;
   }
-  return source_Eat(s, c);
-}
 
-// static struct Parser AsciiBinDigit = {Range, {.Range = {'0', '1'}}};
-// static struct Parser AsciiOctDigit = {Range, {.Range = {'0', '7'}}};
-static struct Parser AsciiDigit = {range, {.Range = {'0', '9'}}};
-// static struct Parser AsciiNonZeroDigit = {Range, {.Range = {'1', '9'}}};
+  std::string_view Name(Symbol sym) const { return Names[sym]; }
 
-inline static struct Source *parseLowercase(struct span *span, struct Source *s)
-{ struct loc start = s->Loc;
+  size_t Size() const { return Names.size(); }
+};
 
-  char first = source_Peek(s);
-  if (first < 0 || !islower(first) || !isalpha(first)) {
-    s->Failed = true;
-    return s;
-  }
-  s = source_Eat(s, first);
+// Whole contents of a script or of the output of a command. Regular files are
+// mapped into memory, pipes and terminals are read in one go, so the lexer
+// always sees a contiguous buffer.
+class Buffer {
+  char *Data{};
+  size_t Size{};
+  size_t Cap{};
+  bool Mapped{};
 
-  while (true) {
-    char c = source_Peek(s);
-    if (!(islower(c) && isalpha(c)) && c != '_') {
-      break;
+  void readAll(int fd) {
+    while (true) {
+      auto n = Append(fd);
+      if (n == 0) {
+        break;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        perror("read file error");
+        panic("load buffer error");
+      }
     }
-    s = source_Eat(s, c);
   }
 
-  *span = (struct span){start, s->Loc};
-  return s;
-}
-
-inline static struct Source *lowercase(union ParserCtx *ctx, struct Source *s) {
-  return parseLowercase(ctx->Span, s);
-}
-
-inline static struct Source *parseAll(struct Parser **parsers, struct Source *s)
-{ struct Parser **parser = parsers; while (*parser) { s =
-(*parser)->Parse(&(*parser)->Ctx, s); if (s->Failed) { return s;
+public:
+  // Empty, to be filled by Append, like the output of commands.
+  Buffer() = default;
+
+  explicit Buffer(FILE *file) {
+    int fd = fileno(file);
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+      perror("stat file error");
+      panic("load buffer error");
+    }
+    if (!S_ISREG(st.st_mode)) {
+      readAll(fd);
+      return;
+    }
+    Size = static_cast<size_t>(st.st_size);
+    if (Size == 0) {
+      return;
     }
-    parser++;
-    if (!s->Atom && *parser) {
-      s = source_SkipSpaces(s);
+    void *p = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      perror("map file error");
+      panic("load buffer error");
     }
+    Data = static_cast<char *>(p);
+    Mapped = true;
   }
-  return s;
-}
 
-inline static struct Source *all(union ParserCtx *ctx, struct Source *s) {
-  return parseAll(ctx->Parsers, s);
-}
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
 
-inline static struct Source *parseAny(struct Parser **parsers, struct Source *s)
-{ struct loc loc = s->Loc; for (struct Parser **parser = parsers; *parser;
-parser++) { s = (*parser)->Parse(&(*parser)->Ctx, s); if (!s->Failed) { return
-s;
+  ~Buffer() {
+    if (Mapped) {
+      munmap(Data, Size);
+      return;
     }
-    s = source_Back(s, loc);
+    free(Data);
   }
-  s->Failed = true;
-  return s;
-}
-
-inline static struct Source *any(union ParserCtx *ctx, struct Source *s) {
-  return parseAny(ctx->Parsers, s);
-}
-
-static struct Parser *EndSymbols[] = {&Semicolon, &Newline, NULL};
-static struct Parser End = {any, {.Parsers = EndSymbols}};
 
-inline static struct Source *parseEnd(struct Source *s) {
-  int sensitive = s->NewlineSensitive;
-  s->NewlineSensitive = true;
-  s = source_SkipSpaces(s);
-  s = End.Parse(&End.Ctx, s);
-  s->NewlineSensitive = sensitive;
-  return s;
-}
-
-inline static struct Source *many(union ParserCtx *ctx, struct Source *s) {
-  while (true) {
-    struct loc loc = s->Loc;
-    s = ctx->Parser->Parse(&ctx->Parser->Ctx, s);
-    if (s->Failed) {
-      return source_Back(s, loc);
+  // Reads once from fd onto the end of a buffer that is not mapped, doubling
+  // it as it fills. Returns what read does.
+  ssize_t Append(int fd) {
+    if (Size == Cap) {
+      Cap = Cap ? Cap * 2 : 4096;
+      Data = static_cast<char *>(realloc(Data, Cap));
+      if (!Data) {
+        panic("out of memory");
+      }
     }
-    if (!s->Atom) {
-      s = source_SkipSpaces(s);
+    auto n = read(fd, Data + Size, Cap - Size);
+    if (n > 0) {
+      Size += static_cast<size_t>(n);
     }
+    return n;
   }
-}
-
-inline static struct Source *option(union ParserCtx *ctx, struct Source *s) {
-  struct loc loc = s->Loc;
-  s = ctx->Parser->Parse(&ctx->Parser->Ctx, s);
-  if (s->Failed) {
-    return source_Back(s, loc);
-  }
-  return s;
-}
 
-enum ExprKind {
-  Expr_App = 1,
-  Expr_Ite,
-  Expr_Lam,
-  Expr_Num,
-  Expr_Unit,
-  Expr_False,
-  Expr_True,
-  Expr_Unresolved,
-  Expr_Resolved,
-};
-union ExprData {
-  struct App *App;
-  struct Ite *Ite;
-  struct Lambda *Lam;
-  struct span Span;
-  int ID;
-};
-struct Expr {
-  enum ExprKind Kind;
-  union ExprData Data;
+  std::string_view View() const { return {Data, Size}; }
 };
 
-inline static struct Source *ParseExpr(struct Expr *expr, struct Source *s);
-
-inline static struct Source *Expr(union ParserCtx *ctx, struct Source *s) {
-  return ParseExpr(ctx->Expr, s);
-}
+enum class TokenKind : uint8_t {
+  Eof,
+  Unknown,
+  Newline,
+  Semicolon,
+  LParen,
+  RParen,
+  Unit,
+  Comma,
+  Assign,
+  Arrow,
+  If,
+  Then,
+  Else,
+  False,
+  True,
+  Ident,
+  Number,
+};
 
-struct App {
-  struct Expr F;
-  struct slice Args;
+struct Token {
+  TokenKind Kind;
+  uint32_t Offset, Length;
 };
 
-inline static void App_Default(struct App *a) { slice_Init(&a->Args,
-sizeof(struct Expr)); }
+// Splits the whole buffer into tokens ahead of parsing. Characters are
+// classified through a table, and runs of blanks, identifier characters and
+// digits are skipped 16 bytes at a time where SSE2 is available.
+class Lexer {
+  enum Class : uint8_t { Other, Blank, Newline, Lower, Digit, Under, Punct };
 
-inline static struct Source *Arg(union ParserCtx *ctx, struct Source *s) {
-  struct Expr a;
-  s = ParseExpr(&a, s);
-  if (!s->Failed) {
-    slice_Append(ctx->Slice, &a);
+  static constexpr auto Classes = [] {
+    std::array<Class, 256> t{};
+    for (auto c : {' ', '\t', '\v', '\f', '\r'}) {
+      t[static_cast<uint8_t>(c)] = Blank;
+    }
+    t['\n'] = Newline;
+    for (auto c = 'a'; c <= 'z'; c++) {
+      t[static_cast<uint8_t>(c)] = Lower;
+    }
+    for (auto c = '0'; c <= '9'; c++) {
+      t[static_cast<uint8_t>(c)] = Digit;
+    }
+    t['_'] = Under;
+    for (auto c : {'(', ')', ',', ';', '='}) {
+      t[static_cast<uint8_t>(c)] = Punct;
+    }
+    return t;
+  }();
+
+  static Class classOf(char c) { return Classes[static_cast<uint8_t>(c)]; }
+
+  std::string_view Input;
+  size_t Pos{};
+  std::vector<Token> Tokens{};
+
+#ifdef __SSE2__
+  // Bytes of v within [lo, hi], as a bit mask.
+  static unsigned inRange(__m128i v, char lo, char hi) {
+    auto d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    auto biased = _mm_xor_si128(d, _mm_set1_epi8(static_cast<char>(0x80)));
+    auto limit = _mm_set1_epi8(static_cast<char>((hi - lo) ^ 0x80));
+    return ~static_cast<unsigned>(
+               _mm_movemask_epi8(_mm_cmpgt_epi8(biased, limit))) &
+           0xFFFFu;
   }
-  return s;
-}
-
-inline static struct Source *Args(union ParserCtx *ctx, struct Source *s) {
-  struct Parser *noArgs[] = {&LParen, &RParen, NULL};
-  struct Parser allNoArgs = {all, {.Parsers = noArgs}};
 
-  struct Parser oneArg = {Arg, {.Slice = ctx->Slice}};
-  struct Parser *otherArgs[] = {&Comma, &oneArg, NULL};
-  struct Parser allOtherArgs = {all, {.Parsers = otherArgs}};
-  struct Parser manyOtherArgs = {many, {.Parser = &allOtherArgs}};
-  struct Parser *multiArgs[] = {&LParen, &oneArg, &manyOtherArgs, &RParen,
-                                NULL};
-  struct Parser allMultiArgs = {all, {.Parsers = multiArgs}};
+  static unsigned is(__m128i v, char c) {
+    return static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))));
+  }
+#endif
 
-  struct Parser *branches[] = {&allNoArgs, &allMultiArgs, NULL};
-  return parseAny(branches, s);
-}
+  // Advances past consecutive characters whose class is accepted by `in`, with
+  // `mask` the vectorized equivalent.
+  template <typename In, typename Mask> void skip(In in, Mask mask) {
+#ifdef __SSE2__
+    while (Pos + 16 <= Input.size()) {
+      auto v = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(Input.data() + Pos));
+      auto m = mask(v);
+      if (m != 0xFFFFu) {
+        Pos += static_cast<size_t>(__builtin_ctz(~m));
+        return;
+      }
+      Pos += 16;
+    }
+#else
+    (void)mask;
+#endif
+    while (Pos < Input.size() && in(classOf(Input[Pos]))) {
+      Pos++;
+    }
+  }
 
-inline static struct Source *Expr_ref(union ParserCtx *ctx, struct Source *s);
-inline static struct Source *Expr_paren(union ParserCtx *ctx, struct Source *s);
+  void skipBlanks() {
+    skip([](Class c) { return c == Blank; },
+         [](auto v) {
+#ifdef __SSE2__
+           return (is(v, ' ') | inRange(v, '\t', '\r')) & ~is(v, '\n');
+#else
+           (void)v;
+           return 0u;
+#endif
+         });
+  }
 
-inline static struct Source *Expr_app(union ParserCtx *ctx, struct Source *s) {
-  struct App *app = new (struct App);
-  App_Default(app);
+  void skipIdent() {
+    skip([](Class c) { return c == Lower || c == Under; },
+         [](auto v) {
+#ifdef __SSE2__
+           return inRange(v, 'a', 'z') | is(v, '_');
+#else
+           (void)v;
+           return 0u;
+#endif
+         });
+  }
 
-  struct Parser fnRef = {Expr_ref, {.Expr = &app->F}};
-  struct Parser fnExpr = {Expr_paren, {.Expr = &app->F}};
-  struct Parser *fnParsers[] = {&fnRef, &fnExpr, NULL};
-  struct Parser f = {any, {.Parsers = fnParsers}};
+  // Digits with single `_` separators between them, like `1_000`.
+  void skipDigits() {
+    auto start = Pos;
+    skip([](Class c) { return c == Digit || c == Under; },
+         [](auto v) {
+#ifdef __SSE2__
+           return inRange(v, '0', '9') | is(v, '_');
+#else
+           (void)v;
+           return 0u;
+#endif
+         });
+    auto end = Pos;
+    for (Pos = start + 1; Pos < end; Pos++) {
+      if (Input[Pos] == '_' &&
+          (Pos + 1 == end || classOf(Input[Pos + 1]) != Digit)) {
+        break;
+      }
+    }
+  }
 
-  struct Parser xs = {Args, {.Slice = &app->Args}};
+  static TokenKind keyword(std::string_view word) {
+    switch (word.size()) {
+    case 2:
+      return word == "if" ? TokenKind::If : TokenKind::Ident;
+    case 4:
+      if (word == "then") {
+        return TokenKind::Then;
+      }
+      if (word == "else") {
+        return TokenKind::Else;
+      }
+      return word == "true" ? TokenKind::True : TokenKind::Ident;
+    case 5:
+      return word == "false" ? TokenKind::False : TokenKind::Ident;
+    default:
+      return TokenKind::Ident;
+    }
+  }
 
-  struct Parser *parsers[] = {&f, &xs, NULL};
-  s = parseAll(parsers, s);
-  if (s->Failed) {
-    free(app);
-    return s;
+  TokenKind punct() {
+    auto c = Input[Pos++];
+    auto next = Pos < Input.size() ? Input[Pos] : '\0';
+    switch (c) {
+    case '(':
+      if (next == ')') {
+        Pos++;
+        return TokenKind::Unit;
+      }
+      return TokenKind::LParen;
+    case ')':
+      return TokenKind::RParen;
+    case ',':
+      return TokenKind::Comma;
+    case ';':
+      return TokenKind::Semicolon;
+    case '=':
+      if (next == '>') {
+        Pos++;
+        return TokenKind::Arrow;
+      }
+      return TokenKind::Assign;
+    default:
+      unreachable();
+    }
   }
-  ctx->Expr->Data.App = app;
-  ctx->Expr->Kind = Expr_App;
-  return s;
-}
 
-struct Ite {
-  struct Expr If, Then, Else;
-};
-
-inline static struct Source *Expr_ite(union ParserCtx *ctx, struct Source *s) {
-  struct Ite *ite = new (struct Ite);
-  struct Parser i = {Expr, {.Expr = &ite->If}};
-  struct Parser t = {Expr, {.Expr = &ite->Then}};
-  struct Parser e = {Expr, {.Expr = &ite->Else}};
-  struct Parser *parsers[] = {&If, &i, &Then, &t, &Else, &e, NULL};
-  s = parseAll(parsers, s);
-  if (s->Failed) {
-    free(ite);
-    return s;
+  void push(TokenKind kind, size_t start) {
+    Tokens.push_back({kind, static_cast<uint32_t>(start),
+                      static_cast<uint32_t>(Pos - start)});
   }
-  ctx->Expr->Kind = Expr_Ite;
-  ctx->Expr->Data.Ite = ite;
-  return s;
-}
 
-struct Param {
-  struct node AsNode;
-  struct span Name;
-};
+  explicit Lexer(std::string_view input) : Input{input} {
+    if (input.size() >= UINT32_MAX) {
+      panic("input too large");
+    }
+    Tokens.reserve(input.size() / 4 + 1);
+  }
 
-inline static struct Source *Param(union ParserCtx *ctx, struct Source *s) {
-  struct span name;
-  s = parseLowercase(&name, s);
-  if (s->Failed) {
-    return s;
+public:
+  static std::vector<Token> Scan(std::string_view input) {
+    Lexer l{input};
+    while (true) {
+      l.skipBlanks();
+      auto start = l.Pos;
+      if (l.Pos == input.size()) {
+        l.push(TokenKind::Eof, start);
+        return std::move(l.Tokens);
+      }
+      switch (classOf(input[l.Pos])) {
+      case Newline:
+        l.Pos++;
+        l.push(TokenKind::Newline, start);
+        break;
+      case Lower:
+        l.skipIdent();
+        l.push(keyword(input.substr(start, l.Pos - start)), start);
+        break;
+      case Digit:
+        l.skipDigits();
+        l.push(TokenKind::Number, start);
+        break;
+      case Punct:
+        l.push(l.punct(), start);
+        break;
+      case Blank:
+      case Under:
+      case Other:
+        l.Pos++;
+        l.push(TokenKind::Unknown, start);
+        break;
+      }
+    }
   }
-  struct Param *param = new (struct Param);
-  node_Default(&param->AsNode);
-  param->Name = name;
-  param->AsNode.Key = IDs_New(s->IDs);
-  *ctx->Nodes = tree_Insert(*ctx->Nodes, (struct node *)param);
-  return s;
-}
+};
 
-inline static struct Source *Params(union ParserCtx *ctx, struct Source *s) {
-  struct Parser *noParams[] = {&LParen, &RParen, NULL};
-  struct Parser allNoParams = {all, {.Parsers = noParams}};
+class Memo;
 
-  struct Parser oneParam = {Param, {.Nodes = ctx->Nodes}};
-  struct Parser *otherParams[] = {&Comma, &oneParam, NULL};
-  struct Parser allOtherParams = {all, {.Parsers = otherParams}};
-  struct Parser manyOtherParams = {many, {.Parser = &allOtherParams}};
-  struct Parser *multiParams[] = {&LParen, &oneParam, &manyOtherParams, &RParen,
-                                  NULL};
-  struct Parser allMultiParams = {all, {.Parsers = multiParams}};
+class Source {
+  std::string_view Input;
+  IDBlock IDs;
+  Symbols &Symbols;
+  Arena &Arena;
+  std::vector<Token> Tokens;
+  mutable std::vector<size_t> Lines{};
 
-  struct Parser *branches[] = {&allNoParams, &allMultiParams, NULL};
-  return parseAny(branches, s);
-}
+public:
+  size_t Pos{}, Backtracks{};
+  bool Failed{}, NewlineSensitive{};
+  // Set once a rule looks at the end of the input, past which a stream may
+  // still go on.
+  mutable bool AtEnd{};
+  class Memo *Memo{};
+
+  // Backtracking point: rewinding also drops everything allocated since,
+  // unless results are memoized and may still be reused.
+  struct Checkpoint {
+    size_t Pos;
+    Arena::Mark Mark;
+  };
+
+  // Left without tokens until Scan unless scan is set.
+  Source(std::string_view input, class IDs &ids, class Symbols &symbols,
+         class Arena &arena, bool scan = true)
+      : Input{input}, IDs{ids}, Symbols{symbols}, Arena{arena},
+        Tokens{scan ? Lexer::Scan(input) : std::vector<Token>{}} {}
+
+  void Scan() { Tokens = Lexer::Scan(Input); }
+
+  class Arena &Alloc() { return Arena; }
+
+  int NewID() { return IDs.New(); }
+
+  // Text of a span is a view into the input buffer, valid for as long as the
+  // buffer lives, so names can be compared and hashed without copying.
+  std::string_view Text(const Span &span) const {
+    return Input.substr(span.Start, span.End - span.Start);
+  }
 
-struct Lambda {
-  struct Param *Params;
-  struct Expr Body;
-};
+  Symbol Intern(const Span &span) { return Symbols.Intern(Text(span)); }
+
+  // Lines and columns are only needed for diagnostics, so line starts are
+  // computed on first use.
+  Loc LocOf(size_t offset) const {
+    if (Lines.empty()) {
+      Lines.push_back(0);
+      for (auto p = Input.data(), end = p + Input.size();;) {
+        p = static_cast<const char *>(
+            memchr(p, '\n', static_cast<size_t>(end - p)));
+        if (!p) {
+          break;
+        }
+        p++;
+        Lines.push_back(static_cast<size_t>(p - Input.data()));
+      }
+    }
+    auto line = std::upper_bound(Lines.begin(), Lines.end(), offset) - 1;
+    return {offset, static_cast<size_t>(line - Lines.begin()) + 1,
+            offset - *line + 1};
+  }
 
-inline static void Lambda_Default(struct Lambda *lam) { lam->Params = NULL; }
+  Loc Where() const { return LocOf(Peek().Offset); }
 
-inline static struct Source *Expr_lambda(union ParserCtx *ctx, struct Source *s)
-{ struct Lambda *lam = new (struct Lambda); Lambda_Default(lam); struct Parser
-ps = {Params, {.Nodes = (struct node **)&lam->Params}}; struct Parser body =
-{Expr, {.Expr = &lam->Body}}; struct Parser *parsers[] = {&ps, &Arrow, &body,
-NULL}; s = parseAll(parsers, s); if (s->Failed) { free(lam); return s;
+  const Token &Peek() const {
+    if (Pos + 1 == Tokens.size()) {
+      AtEnd = true;
+    }
+    return Tokens[Pos];
   }
-  ctx->Expr->Kind = Expr_Lam;
-  ctx->Expr->Data.Lam = lam;
-  return s;
-}
 
-inline static struct Source *decimalDigits(union ParserCtx *ctx, struct Source
-*s) { struct loc loc = s->Loc; struct Parser optionalUnder = {option, {.Parser =
-&Under}}; struct Parser *otherDigits[] = {&optionalUnder, &AsciiDigit, NULL};
-  struct Parser allOtherDigits = {all, {.Parsers = otherDigits}};
-  struct Parser manyOtherDigits = {many, {.Parser = &allOtherDigits}};
-  struct Parser *digits[] = {&AsciiDigit, &manyOtherDigits, NULL};
-  s = parseAll(digits, s);
-  if (!s->Failed) {
-    *ctx->Span = (struct span){loc, s->Loc};
+  Span SpanOf(const Token &t) const { return {t.Offset, t.Offset + t.Length}; }
+
+  // Offset just past the last consumed token.
+  size_t Offset() const {
+    if (Pos == 0) {
+      return 0;
+    }
+    auto &t = Tokens[Pos - 1];
+    return t.Offset + t.Length;
   }
-  return s;
-}
 
-inline static struct Source *decimalNumber(union ParserCtx *ctx, struct Source
-*s) { struct Parser parser = {decimalDigits, {.Span = ctx->Span}}; return
-parseAtom(&parser, s);
-}
+  Checkpoint Save() const { return {Pos, Arena.Checkpoint()}; }
 
-inline static struct Source *Number(union ParserCtx *ctx, struct Source *s) {
-  return decimalNumber(ctx, s);
-}
+  Source &Back(const Checkpoint &c) {
+    Backtracks++;
+    Pos = c.Pos;
+    Failed = false;
+    if (!Memo) {
+      Arena.Rollback(c.Mark);
+    }
+    return *this;
+  }
 
-inline static struct Source *Expr_number(union ParserCtx *ctx, struct Source *s)
-{ struct span num; union ParserCtx num_ctx = {.Span = &num}; s =
-Number(&num_ctx, s); if (!s->Failed) { ctx->Expr->Kind = Expr_Num;
-    ctx->Expr->Data.Span = num;
+  Source &Eat(TokenKind kind) {
+    if (Peek().Kind != kind) {
+      Failed = true;
+      return *this;
+    }
+    Pos++;
+    return *this;
   }
-  return s;
-}
 
-inline static struct Source *Expr_unit(union ParserCtx *ctx, struct Source *s) {
-  s = Unit.Parse(&Unit.Ctx, s);
-  if (!s->Failed) {
-    ctx->Expr->Kind = Expr_Unit;
+  Source &SkipSpaces() {
+    while (!NewlineSensitive && Peek().Kind == TokenKind::Newline) {
+      Pos++;
+    }
+    return *this;
   }
-  return s;
-}
+};
+
+struct Expr;
+struct Param;
+struct Def;
 
-inline static struct Source *Expr_false(union ParserCtx *ctx, struct Source *s)
-{ s = False.Parse(&False.Ctx, s); if (!s->Failed) { ctx->Expr->Kind =
-Expr_False;
+// Grammar rules are types with a static Parse taking the input and the
+// values the rule fills in. Combinators pass those on to every part, and
+// Call hands one of them to a function. Rules are composed at compile time,
+// so a grammar inlines into direct calls without building anything per call.
+
+struct Soi {
+  template <typename... A> static Source &Parse(Source &s, A &...) {
+    if (s.Pos != 0) {
+      s.Failed = true;
+    }
+    return s;
   }
-  return s;
-}
+};
 
-inline static struct Source *Expr_true(union ParserCtx *ctx, struct Source *s) {
-  s = True.Parse(&True.Ctx, s);
-  if (!s->Failed) {
-    ctx->Expr->Kind = Expr_True;
+struct Eoi {
+  template <typename... A> static Source &Parse(Source &s, A &...) {
+    if (s.Peek().Kind != TokenKind::Eof) {
+      s.Failed = true;
+    }
+    return s;
   }
-  return s;
-}
+};
+
+// One token of the given kind.
+template <TokenKind Kind> struct Lit {
+  template <typename... A> static Source &Parse(Source &s, A &...) {
+    return s.Eat(Kind);
+  }
+};
+
+using LParen = Lit<TokenKind::LParen>;
+using RParen = Lit<TokenKind::RParen>;
+using Comma = Lit<TokenKind::Comma>;
+using Newline = Lit<TokenKind::Newline>;
+using Semicolon = Lit<TokenKind::Semicolon>;
+using Assign = Lit<TokenKind::Assign>;
+using If = Lit<TokenKind::If>;
+using Then = Lit<TokenKind::Then>;
+using Else = Lit<TokenKind::Else>;
+using Arrow = Lit<TokenKind::Arrow>;
+using Unit = Lit<TokenKind::Unit>;
+
+// Calls f with the value at index N, f being a Source &(T &, Source &).
+template <auto F, size_t N = 0> struct Call {
+  template <typename... A> static Source &Parse(Source &s, A &...a) {
+    return F(std::get<N>(std::tie(a...)), s);
+  }
+};
+
+// Runs p on the value at index N alone.
+template <size_t N, typename P> struct At {
+  template <typename... A> static Source &Parse(Source &s, A &...a) {
+    return P::Parse(s, std::get<N>(std::tie(a...)));
+  }
+};
+
+// Every rule in order, with spaces skipped between them.
+template <typename P, typename... Ps> struct All {
+  template <typename... A> static Source &Parse(Source &s, A &...a) {
+    P::Parse(s, a...);
+    if constexpr (sizeof...(Ps) > 0) {
+      if (!s.Failed) {
+        s.SkipSpaces();
+        All<Ps...>::Parse(s, a...);
+      }
+    }
+    return s;
+  }
+};
+
+// The first rule that succeeds, each tried from the same start.
+template <typename... Ps> struct Any {
+  template <typename P, typename... A>
+  static bool attempt(Source &s, const Source::Checkpoint &saved, A &...a) {
+    P::Parse(s, a...);
+    if (!s.Failed) {
+      return true;
+    }
+    s.Back(saved);
+    return false;
+  }
+
+  template <typename... A> static Source &Parse(Source &s, A &...a) {
+    auto saved = s.Save();
+    if (!(attempt<Ps>(s, saved, a...) || ...)) {
+      s.Failed = true;
+    }
+    return s;
+  }
+};
+
+template <typename P> struct Many {
+  template <typename... A> static Source &Parse(Source &s, A &...a) {
+    while (true) {
+      auto saved = s.Save();
+      P::Parse(s, a...);
+      if (s.Failed) {
+        return s.Back(saved);
+      }
+      s.SkipSpaces();
+    }
+  }
+};
 
-inline static struct Source *Expr_ref(union ParserCtx *ctx, struct Source *s) {
-  struct span ref;
-  s = parseLowercase(&ref, s);
-  if (!s->Failed) {
-    ctx->Expr->Kind = Expr_Unresolved;
-    ctx->Expr->Data.Span = ref;
+static inline Source &parseToken(TokenKind kind, Span &span, Source &s) {
+  auto &t = s.Peek();
+  s.Eat(kind);
+  if (!s.Failed) {
+    span = s.SpanOf(t);
   }
   return s;
 }
 
-inline static struct Source *Expr_paren(union ParserCtx *ctx, struct Source *s)
-{ struct Parser e = {Expr, {.Expr = ctx->Expr}}; struct Parser *parsers[] =
-{&LParen, &e, &RParen, NULL}; return parseAll(parsers, s);
+static inline Source &parseLowercase(Span &span, Source &s) {
+  return parseToken(TokenKind::Ident, span, s);
 }
 
-inline static struct Source *ParseExpr(struct Expr *expr, struct Source *s) {
-  struct Parser app = {Expr_app, {.Expr = expr}};
-  struct Parser ite = {Expr_ite, {.Expr = expr}};
-  struct Parser lam = {Expr_lambda, {.Expr = expr}};
-  struct Parser num = {Expr_number, {.Expr = expr}};
-  struct Parser unit = {Expr_unit, {.Expr = expr}};
-  struct Parser fl = {Expr_false, {.Expr = expr}};
-  struct Parser tr = {Expr_true, {.Expr = expr}};
-  struct Parser ref = {Expr_ref, {.Expr = expr}};
-  struct Parser paren = {Expr_paren, {.Expr = expr}};
-  struct Parser *branches[] = {&app, &ite, &lam, &num,   &unit,
-                               &fl,  &tr,  &ref, &paren, NULL};
-  return parseAny(branches, s);
+using End = Any<Semicolon, Newline>;
+
+static inline Source &parseEnd(Source &s) {
+  bool sensitive = s.NewlineSensitive;
+  s.NewlineSensitive = true;
+  End::Parse(s);
+  s.NewlineSensitive = sensitive;
+  return s;
 }
 
-enum DefKind { Def_Fn = 1, Def_Val };
-union DefBody {
-  struct Expr Ret;
+enum class ExprKind {
+  App = 1,
+  Ite,
+  Lam,
+  Num,
+  Unit,
+  False,
+  True,
+  Unresolved,
+  Resolved,
 };
 
-struct Def {
-  struct node AsNode;
+union ExprData {
+  struct App *App;
+  struct Ite *Ite;
+  struct Lambda *Lam;
+  Symbol Name;
+  int ID;
+};
 
-  struct span Name;
-  struct Param *Params;
-  enum DefKind Kind;
-  union DefBody Body;
+struct Expr {
+  ExprKind Kind{};
+  ExprData Data{};
+  struct Span Span{};
 };
 
-inline static void Def_Default(struct Def *d) {
-  node_Default(&d->AsNode);
-  d->Params = NULL;
-}
+// Packrat memo table: the outcome of a rule at an input offset, so that
+// backtracking alternatives never parse the same prefix twice.
+class Memo {
+public:
+  enum class Rule : uint8_t { Expr, Paren };
+
+private:
+  struct Entry {
+    bool Failed;
+    size_t End;
+    struct Expr Value;
+  };
+
+  std::unordered_map<uint64_t, Entry> Entries{};
+
+  // Newline sensitivity changes what a rule consumes, so it is part of the key.
+  static uint64_t key(Rule rule, const Source &s) {
+    return static_cast<uint64_t>(s.Pos) << 2 |
+           static_cast<uint64_t>(rule) << 1 |
+           static_cast<uint64_t>(s.NewlineSensitive);
+  }
 
-inline static struct Source *Fn(union ParserCtx *ctx, struct Source *s) {
-  struct Parser name = {lowercase, {.Span = &ctx->Def->Name}};
-  struct Parser ps = {Params, {.Nodes = (struct node **)&ctx->Def->Params}};
-  struct Parser ret = {Expr, {.Expr = &ctx->Def->Body.Ret}};
-  struct Parser *parsers[] = {&name, &ps, &ret, NULL};
-  s = parseAll(parsers, s);
-  if (s->Failed) {
+public:
+  size_t Hits{};
+
+  template <typename F>
+  Source &Apply(Rule rule, struct Expr &e, Source &s, F &&parse) {
+    auto k = key(rule, s);
+    if (auto it = Entries.find(k); it != Entries.end()) {
+      Hits++;
+      s.Pos = it->second.End;
+      s.Failed = it->second.Failed;
+      if (!s.Failed) {
+        e = it->second.Value;
+      }
+      return s;
+    }
+    parse(e, s);
+    Entries.insert({k, {s.Failed, s.Pos, e}});
     return s;
   }
-  s = parseEnd(s);
-  if (!s->Failed) {
-    ctx->Def->Kind = Def_Fn;
+};
+
+static inline Source &ParseExpr(Expr &expr, Source &s);
+
+struct App {
+  Expr F;
+  Slice<Expr> Args;
+};
+
+static inline Source &arg(std::vector<Expr> &args, Source &s) {
+  Expr a{};
+  ParseExpr(a, s);
+  if (!s.Failed) {
+    args.push_back(a);
   }
   return s;
 }
 
-inline static struct Source *Val(union ParserCtx *ctx, struct Source *s) {
-  struct Parser name = {lowercase, {.Span = &ctx->Def->Name}};
-  struct Parser ret = {Expr, {.Expr = &ctx->Def->Body.Ret}};
-  struct Parser *parsers[] = {&name, &Assign, &ret, NULL};
-  s = parseAll(parsers, s);
-  if (s->Failed) {
+using Args = Any<Unit, All<LParen, RParen>,
+                 All<LParen, Call<arg>, Many<All<Comma, Call<arg>>>, RParen>>;
+
+static inline Source &exprRef(Expr &e, Source &s);
+static inline Source &exprParen(Expr &e, Source &s);
+
+static inline Source &exprApp(Expr &e, Source &s) {
+  auto start = s.Peek().Offset;
+  Expr f{};
+  std::vector<Expr> xs;
+  All<Any<Call<exprRef>, Call<exprParen>>, At<1, Args>>::Parse(s, f, xs);
+  if (s.Failed) {
     return s;
   }
-  s = parseEnd(s);
-  if (!s->Failed) {
-    ctx->Def->Kind = Def_Val;
-  }
+  auto app = s.Alloc().New<App>(f, Slice<Expr>::From(s.Alloc(), xs));
+  e = {ExprKind::App, {}, {start, s.Offset()}};
+  e.Data.App = app;
   return s;
 }
 
-inline static struct Source *Def(union ParserCtx *ctx, struct Source *s) {
-  struct Def *d = new (struct Def);
-  Def_Default(d);
-
-  struct Parser fn = {Fn, {.Def = d}};
-  struct Parser val = {Val, {.Def = d}};
+struct Ite {
+  Expr If, Then, Else;
+};
 
-  struct Parser *branches[] = {&fn, &val, NULL};
-  s = parseAny(branches, s);
-  if (s->Failed) {
-    free(d);
+static inline Source &exprIte(Expr &e, Source &s) {
+  auto start = s.Peek().Offset;
+  Expr i{}, t{}, el{};
+  All<If, Call<ParseExpr, 0>, Then, Call<ParseExpr, 1>, Else,
+      Call<ParseExpr, 2>>::Parse(s, i, t, el);
+  if (s.Failed) {
     return s;
   }
-  d->AsNode.Key = IDs_New(s->IDs);
-  *ctx->Nodes = tree_Insert(*ctx->Nodes, (struct node *)d);
+  e = {ExprKind::Ite, {}, {start, s.Offset()}};
+  e.Data.Ite = s.Alloc().New<Ite>(i, t, el);
   return s;
 }
 
-struct Program {
-  struct Def *Defs;
+struct Param {
+  struct Span Name;
+  Symbol Sym;
+  int ID;
 };
 
-inline static void Program_Default(struct Program *p) { p->Defs = NULL; }
-
-inline static struct Source *ParseProgram(struct Def **defs, struct Source *s) {
-  struct Parser oneDef = {Def, {.Nodes = (struct node **)defs}};
-  struct Parser manyDefs = {many, {.Parser = &oneDef}};
-  struct Parser *parsers[] = {&Soi, &manyDefs, &Eoi, NULL};
-  return parseAll(parsers, s);
+static inline Source &param(SmallVector<Param, 4> &params, Source &s) {
+  Span name{};
+  parseLowercase(name, s);
+  if (s.Failed) {
+    return s;
+  }
+  params.push_back({name, s.Intern(name), s.NewID()});
+  return s;
 }
 
-enum Resolution { Resolution_OK, Resolution_NotFound, Resolution_Duplicate };
+using Params =
+    Any<Unit, All<LParen, RParen>,
+        All<LParen, Call<param>, Many<All<Comma, Call<param>>>, RParen>>;
 
-inline static const char *Resolution_ToString(enum Resolution state) {
-  switch (state) {
-  case Resolution_OK:
-    return "resolved successfully";
-  case Resolution_NotFound:
-    return "variable not found";
-  case Resolution_Duplicate:
-    return "duplicate variable";
+struct Lambda {
+  Slice<Param> Params;
+  Expr Body;
+};
+
+static inline Source &exprLambda(Expr &e, Source &s) {
+  auto start = s.Peek().Offset;
+  SmallVector<Param, 4> ps{};
+  Expr body{};
+  All<At<0, Params>, Arrow, Call<ParseExpr, 1>>::Parse(s, ps, body);
+  if (s.Failed) {
+    return s;
   }
+  e = {ExprKind::Lam, {}, {start, s.Offset()}};
+  e.Data.Lam = s.Alloc().New<Lambda>(Slice<Param>::From(s.Alloc(), ps), body);
+  return s;
 }
 
-struct Resolver {
-  struct Source *Src;
-  struct map Globals, Locals, Params;
-  enum Resolution State;
-  struct span NameSpan;
-  const char *NameText;
-};
-
-inline static void Resolver_Init(struct Resolver *r, struct Source *s) {
-  r->Src = s;
-  map_Default(&r->Globals);
-  r->State = Resolution_OK;
-  r->NameText = NULL;
+static inline Source &exprNumber(Expr &e, Source &s) {
+  Span num{};
+  parseToken(TokenKind::Number, num, s);
+  if (!s.Failed) {
+    e = {ExprKind::Num, {}, num};
+  }
+  return s;
 }
 
-inline static void Resolver_Free(struct Resolver *r) {
-  map_Free(&r->Globals);
-  if (r->NameText) {
-    free((void *)r->NameText);
+template <TokenKind Keyword, ExprKind Kind>
+static inline Source &exprKeyword(Expr &e, Source &s) {
+  Span span{};
+  parseToken(Keyword, span, s);
+  if (!s.Failed) {
+    e = {Kind, {}, span};
   }
+  return s;
 }
 
-inline static void Resolver_Expr(struct Resolver *r, struct Expr *e);
+static inline Source &exprRef(Expr &e, Source &s) {
+  Span ref{};
+  parseLowercase(ref, s);
+  if (!s.Failed) {
+    e = {ExprKind::Unresolved, {}, ref};
+    e.Data.Name = s.Intern(ref);
+  }
+  return s;
+}
 
-inline static void Resolver_resolveArg(void *data, void *arg) {
-  Resolver_Expr((struct Resolver *)data, (struct Expr *)arg);
+static inline Source &parseParen(Expr &e, Source &s) {
+  return All<LParen, Call<ParseExpr>, RParen>::Parse(s, e);
 }
 
-inline static void Resolver_validateLocal(void *data, struct node *node) {
-  struct Resolver *r = data;
-  if (r->State != Resolution_OK) {
-    return;
-  }
-  struct Param *p = (struct Param *)node;
-  const char *nameText = source_NewText(r->Src, p->Name);
-  if (map_Set(&r->Params, nameText, p->AsNode.Key)) {
-    r->State = Resolution_Duplicate;
-    r->NameSpan = p->Name;
-    r->NameText = nameText;
+static inline Source &exprParen(Expr &e, Source &s) {
+  if (s.Memo) {
+    return s.Memo->Apply(Memo::Rule::Paren, e, s, parseParen);
   }
+  return parseParen(e, s);
 }
 
-inline static void Resolver_insertLocal(void *data, struct node *node) {
-  struct Resolver *r = data;
-  if (r->State != Resolution_OK) {
-    return;
-  }
-  struct Param *p = (struct Param *)node;
-  const char *nameText = source_NewText(r->Src, p->Name);
-  if (map_Set(&r->Locals, nameText, p->AsNode.Key)) {
-    free((void *)nameText);
-  }
+static inline Source &parseExpr(Expr &e, Source &s) {
+  return Any<Call<exprApp>, Call<exprIte>, Call<exprLambda>, Call<exprNumber>,
+             Call<exprKeyword<TokenKind::Unit, ExprKind::Unit>>,
+             Call<exprKeyword<TokenKind::False, ExprKind::False>>,
+             Call<exprKeyword<TokenKind::True, ExprKind::True>>,
+             Call<exprRef>, Call<exprParen>>::Parse(s, e);
 }
 
-inline static void Resolver_insertLocals(struct Resolver *r, struct Param
-*params) { map_Default(&r->Params); tree_Iter(r, (struct node *)params,
-Resolver_validateLocal); if (r->State != Resolution_OK) { return;
+static inline Source &ParseExpr(Expr &e, Source &s) {
+  if (s.Memo) {
+    return s.Memo->Apply(Memo::Rule::Expr, e, s, parseExpr);
   }
-  map_Merge(&r->Locals, &r->Params);
-  tree_Iter(r, (struct node *)params, Resolver_insertLocal);
+  return parseExpr(e, s);
 }
 
-inline static void Resolver_Expr(struct Resolver *r, struct Expr *e) {
-  switch (e->Kind) {
-  case Expr_App: {
-    Resolver_Expr(r, &e->Data.App->F);
-    if (r->State != Resolution_OK) {
-      return;
-    }
-    slice_Iter(r, &e->Data.App->Args, Resolver_resolveArg);
-    return;
-  }
-  case Expr_Ite: {
-    Resolver_Expr(r, &e->Data.Ite->If);
-    if (r->State != Resolution_OK) {
-      return;
-    }
-    Resolver_Expr(r, &e->Data.Ite->Then);
-    if (r->State != Resolution_OK) {
-      return;
-    }
-    Resolver_Expr(r, &e->Data.Ite->Else);
-    return;
-  }
-  case Expr_Lam: {
-    Resolver_insertLocals(r, e->Data.Lam->Params);
-    if (r->State != Resolution_OK) {
-      return;
-    }
-    Resolver_Expr(r, &e->Data.Lam->Body);
-    return;
-  }
-  case Expr_Unresolved: {
-    const char *nameText = source_NewText(r->Src, e->Data.Span);
-    int id;
-    if (map_Get(&r->Locals, nameText, &id) ||
-        map_Get(&r->Globals, nameText, &id)) {
-      free((void *)nameText);
-      e->Kind = Expr_Resolved;
-      e->Data.ID = id;
-      return;
-    }
-    r->State = Resolution_NotFound;
-    r->NameSpan = e->Data.Span;
-    r->NameText = nameText;
-    return;
+enum class DefKind { Fn = 1, Val };
+
+struct Def {
+  struct Span Name;
+  Symbol Sym;
+  int ID;
+  Slice<Param> Params;
+  DefKind Kind;
+  Expr Ret;
+};
+
+static inline Source &fn(Def &d, Source &s) {
+  SmallVector<Param, 4> ps{};
+  All<Call<parseLowercase, 0>, At<1, Params>, Call<ParseExpr, 2>>::Parse(
+      s, d.Name, ps, d.Ret);
+  if (s.Failed) {
+    return s;
   }
-  case Expr_Num:
-  case Expr_Unit:
-  case Expr_False:
-  case Expr_True:
-    return;
-  case Expr_Resolved:
-    unreachable();
+  parseEnd(s);
+  if (!s.Failed) {
+    d.Kind = DefKind::Fn;
+    d.Params = Slice<Param>::From(s.Alloc(), ps);
   }
+  return s;
 }
 
-inline static void Resolver_insertGlobal(void *data, struct node *node) {
-  struct Resolver *r = data;
-  if (r->State != Resolution_OK) {
-    return;
+static inline Source &val(Def &d, Source &s) {
+  All<Call<parseLowercase, 0>, Assign, Call<ParseExpr, 1>>::Parse(s, d.Name,
+                                                                  d.Ret);
+  if (s.Failed) {
+    return s;
   }
-
-  struct Def *d = (struct Def *)node;
-  const char *nameText = source_NewText(r->Src, d->Name);
-  if (map_Set(&r->Globals, nameText, d->AsNode.Key)) {
-    r->State = Resolution_Duplicate;
-    r->NameSpan = d->Name;
-    r->NameText = nameText;
-    return;
+  parseEnd(s);
+  if (!s.Failed) {
+    d.Kind = DefKind::Val;
   }
+  return s;
+}
 
-  map_Default(&r->Locals);
-  Resolver_insertLocals(r, d->Params);
-  if (r->State == Resolution_OK) {
-    Resolver_Expr(r, &d->Body.Ret);
+static inline Source &def(std::vector<Def> &defs, Source &s) {
+  Def d{};
+  Any<Call<fn>, Call<val>>::Parse(s, d);
+  if (s.Failed) {
+    return s;
   }
-  map_Free(&r->Locals);
+  d.Sym = s.Intern(d.Name);
+  d.ID = s.NewID();
+  defs.push_back(d);
+  return s;
 }
 
-inline static void Resolver_Program(struct Resolver *r, struct Program *p) {
-  tree_Iter(r, (struct node *)p->Defs, Resolver_insertGlobal);
+struct Program {
+  std::vector<Def> Defs{};
+};
+
+static inline Source &ParseProgram(Program &p, Source &s) {
+  return All<Soi, Many<Call<def>>, Eoi>::Parse(s, p.Defs);
 }
 
-enum TermKind {
-  Term_Univ = 1,
+// Parses one more definition into p, for input that arrives in parts.
+static inline Source &ParseDef(Program &p, Source &s) { return def(p.Defs, s); }
+
+} // namespace parsing
+
+// Data-oriented layout of a parsed program. Nodes of each kind live in their
+// own array and refer to each other by 32-bit index; the arguments of an
+// application and the parameters of a function are contiguous index ranges.
+// With no pointers inside, the arrays can be walked sequentially and written
+// out as they are.
+namespace flat {
+
+using parsing::DefKind;
+using parsing::ExprKind;
+using parsing::Symbol;
 
-  Term_FnType,
-  Term_NumType,
-  Term_UnitType,
-  Term_BoolType,
+using Index = uint32_t;
 
-  Term_Fn,
-  Term_Num,
-  Term_Unit,
-  Term_False,
-  Term_True,
+struct Range {
+  Index Begin, Size;
+
+  Index end() const { return Begin + Size; }
 };
 
-struct Term {
-  enum TermKind Kind;
+struct Expr {
+  ExprKind Kind;
+  // Index into Apps/Ites/Lams, the symbol of an unresolved name, or the ID of
+  // a resolved one, depending on Kind.
+  uint32_t Data;
+  uint32_t Start, End;
 };
 
-enum ThmKind { Thm_Undefined = 1 };
+struct App {
+  Index F;
+  Range Args;
+};
 
-struct Thm {
-  struct node AsNode;
+struct Ite {
+  Index If, Then, Else;
+};
 
-  enum ThmKind Kind;
+struct Lam {
+  Range Params;
+  Index Body;
 };
 
-enum ElabStateKind {
-  Elaboration_OK,
-  Elaboration_CheckFailed,
-  Elaboration_InferFailed
+struct Param {
+  Symbol Sym;
+  int ID;
+  uint32_t Start, End;
 };
 
-struct ElabState {
-  enum ElabStateKind Kind;
-  struct Expr *Expr;
-  struct Term *Got, *Expected;
+struct Def {
+  Symbol Sym;
+  int ID;
+  DefKind Kind;
+  Range Params;
+  Index Ret;
+  uint32_t Start, End;
 };
 
-inline static void ElabState_Default(struct ElabState *s) {
-  s->Kind = Elaboration_OK;
-  s->Expr = NULL;
-  s->Got = NULL;
-  s->Expr = NULL;
-}
+class Program {
+  static uint32_t offset(size_t pos) { return static_cast<uint32_t>(pos); }
 
-struct Elab {
-  struct node *Metas, *Globals, *Locals;
-  struct IDs *IDs;
-  struct ElabState State;
-};
+  template <typename T> static Index next(const std::vector<T> &xs) {
+    if (xs.size() >= UINT32_MAX) {
+      panic("program too large");
+    }
+    return static_cast<Index>(xs.size());
+  }
 
-inline static void Elab_Init(struct Elab *e, struct IDs *ids) {
-  e->Metas = NULL;
-  e->Globals = NULL;
-  e->Locals = NULL;
-  e->IDs = ids;
-  ElabState_Default(&e->State);
-}
+  Range params(const Slice<parsing::Param> &ps) {
+    Range r{next(Params), static_cast<Index>(ps.Size)};
+    for (auto &p : ps) {
+      Params.push_back(
+          {p.Sym, p.ID, offset(p.Name.Start), offset(p.Name.End)});
+    }
+    return r;
+  }
 
-inline static void Elab_Check(struct Elab *e, struct Expr *ex, struct Term *ty)
-{ (void)e; switch (ex->Kind) { case Expr_App:
-    // TODO
-    panic("TODO: application");
-  case Expr_Ite:
-    // TODO
-    panic("TODO: if-then-else");
-  case Expr_Lam:
-    // TODO
-    panic("TODO: lambda");
-  case Expr_Num:
-    if (ty->Kind == Term_NumType) {
+  void fill(Index i, const parsing::Expr &e) {
+    Exprs[i] = {e.Kind, 0, offset(e.Span.Start), offset(e.Span.End)};
+    switch (e.Kind) {
+    case ExprKind::App: {
+      auto &a = *e.Data.App;
+      auto f = expr(a.F);
+      auto app = next(Apps);
+      Apps.push_back({f, {0, 0}});
+      Range args{next(Exprs), static_cast<Index>(a.Args.Size)};
+      Exprs.resize(args.end());
+      for (Index j = 0; j < args.Size; j++) {
+        fill(args.Begin + j, a.Args[j]);
+      }
+      Apps[app].Args = args;
+      Exprs[i].Data = app;
       return;
     }
-    // TODO
-    panic("TODO: fail");
-  case Expr_Unit:
-    if (ty->Kind == Term_UnitType) {
+    case ExprKind::Ite: {
+      auto &ite = *e.Data.Ite;
+      Ite n{expr(ite.If), expr(ite.Then), expr(ite.Else)};
+      Exprs[i].Data = next(Ites);
+      Ites.push_back(n);
       return;
     }
-    // TODO
-    panic("TODO: fail");
-  case Expr_False:
-  case Expr_True:
-    if (ty->Kind == Term_BoolType) {
+    case ExprKind::Lam: {
+      auto ps = params(e.Data.Lam->Params);
+      Lam n{ps, expr(e.Data.Lam->Body)};
+      Exprs[i].Data = next(Lams);
+      Lams.push_back(n);
+      return;
+    }
+    case ExprKind::Unresolved:
+      Exprs[i].Data = e.Data.Name;
+      return;
+    case ExprKind::Resolved:
+      Exprs[i].Data = static_cast<uint32_t>(e.Data.ID);
+      return;
+    case ExprKind::Num:
+    case ExprKind::Unit:
+    case ExprKind::False:
+    case ExprKind::True:
       return;
     }
-    // TODO
-    panic("TODO: fail");
-  case Expr_Resolved:
-    // TODO
-    panic("TODO: reference");
-  case Expr_Unresolved:
-    unreachable();
   }
-}
 
-inline static void Elab_Infer(struct Elab *e, struct Expr *ex, struct Term *tm,
-                struct Term *ty) {
-  (void)e;
-  switch (ex->Kind) {
-  case Expr_App:
-    // TODO
-    panic("TODO: application");
-  case Expr_Ite:
-    // TODO
-    panic("TODO: if-then-else");
-  case Expr_Lam:
-    tm->Kind = Term_Fn;
-    ty->Kind = Term_FnType;
-    // TODO
-    panic("TODO: lambda");
-  case Expr_Num:
-    tm->Kind = Term_Num;
-    ty->Kind = Term_NumType;
-    return;
-  case Expr_Unit:
-    tm->Kind = Term_Unit;
-    ty->Kind = Term_UnitType;
-    return;
-  case Expr_False:
-    tm->Kind = Term_False;
-    ty->Kind = Term_BoolType;
-    return;
-  case Expr_True:
-    tm->Kind = Term_True;
-    ty->Kind = Term_BoolType;
-    return;
-  case Expr_Resolved:
-    // TODO
-    panic("TODO: reference");
-  case Expr_Unresolved:
-    unreachable();
+  Index expr(const parsing::Expr &e) {
+    auto i = next(Exprs);
+    Exprs.emplace_back();
+    fill(i, e);
+    return i;
   }
-}
-
-// void Elab_Def(struct Elab *e, struct Def *d) {}
-// void Elab_Program(struct Elab *e, struct Program *p) {}
-
-struct Driver {
-  const char *Filename;
-  FILE *Infile;
-  struct IDs IDs;
-  struct Source Src;
-};
 
-inline static int Driver_runScript(struct Driver *d, const char *filename) {
-  source_Init(&d->Src, d->Infile, &d->IDs);
-  struct Program p;
-  Program_Default(&p);
-  struct Source *s = ParseProgram(&p.Defs, &d->Src);
-  if (s->Failed) {
-    printf("%s:%lu:%lu: Parse error (pos=%lu)\n", d->Filename, s->Loc.Ln,
-           s->Loc.Col, s->Loc.Pos);
-    return -1;
+public:
+  std::vector<Expr> Exprs{};
+  std::vector<App> Apps{};
+  std::vector<Ite> Ites{};
+  std::vector<Lam> Lams{};
+  std::vector<Param> Params{};
+  std::vector<Def> Defs{};
+
+  static Program From(const parsing::Program &p) {
+    Program f{};
+    for (auto &d : p.Defs) {
+      Def n{d.Sym, d.ID, d.Kind,           f.params(d.Params),
+            0,     offset(d.Name.Start), offset(d.Name.End)};
+      n.Ret = f.expr(d.Ret);
+      f.Defs.push_back(n);
+    }
+    return f;
   }
 
-  struct Resolver resolver;
-  Resolver_Init(&resolver, &d->Src);
-  Resolver_Program(&resolver, &p);
-  if (resolver.State == Resolution_OK) {
-    return 0;
+  size_t Nodes() const {
+    return Exprs.size() + Apps.size() + Ites.size() + Lams.size() +
+           Params.size() + Defs.size();
   }
 
-  printf("%s:%lu:%lu: resolve error: %s \"%s\"\n", d->Filename,
-         resolver.NameSpan.Start.Ln, resolver.NameSpan.Start.Col,
-         Resolution_ToString(resolver.State), resolver.NameText);
-  return -1;
-}
-
-inline static int Driver_Run(struct Driver *d, int argc, const char *argv[]) {
-  switch (argc) {
-  case 2: {
-    if (strcmp(argv[1], "help") == 0) {
-      return Driver_printUsage();
-    }
-    if (strcmp(argv[1], "version") == 0) {
-      return Driver_printVersion();
-    }
-    break;
+  size_t Bytes() const {
+    return Exprs.size() * sizeof(Expr) + Apps.size() * sizeof(App) +
+           Ites.size() * sizeof(Ite) + Lams.size() * sizeof(Lam) +
+           Params.size() * sizeof(Param) + Defs.size() * sizeof(Def);
   }
-  case 3:
-    if (strcmp(argv[1], "run") == 0) {
-      return Driver_runScript(d, argv[2]);
-    }
-    break;
-  default:
-    break;
-  }
-  Driver_printUsage();
-  return -1;
-}
-*/
+};
 
-namespace jian {
+} // namespace flat
 
-class Error {
-  [[maybe_unused]] const char *Msg;
+namespace resolving {
 
-public:
-  explicit Error(const char *msg) : Msg{msg} {}
-};
+using parsing::Symbol;
 
-template <typename T> using Result = std::variant<T, Error>;
+// Name bindings indexed directly by interned symbol, so a lookup is a single
+// array load. Bindings made inside a scope remember what they shadowed, and
+// popping the scope restores the outer bindings in place.
+class Scopes {
+  struct Binding {
+    int ID{};
+    size_t Depth{};
+  };
 
-namespace parsing {
+  struct Shadowed {
+    Symbol Sym;
+    Binding Prev;
+  };
 
-class IDs {
-  volatile int Next{};
+  std::vector<Binding> Bindings{};
+  std::vector<Shadowed> Undo{};
+  std::vector<size_t> Marks{};
 
 public:
-  int New() {
-    Next++;
-    return Next;
+  void Push() { Marks.push_back(Undo.size()); }
+
+  void Pop() {
+    auto mark = Marks.back();
+    Marks.pop_back();
+    while (Undo.size() > mark) {
+      auto &u = Undo.back();
+      Bindings[u.Sym] = u.Prev;
+      Undo.pop_back();
+    }
   }
-};
-
-struct Loc {
-  size_t Pos{}, Ln{1}, Col{1};
 
-  void NextLine() {
-    Pos++;
-    Ln++;
-    Col = 1;
+  // Returns false if the name is already bound in the innermost scope.
+  bool Bind(Symbol sym, int id) {
+    if (sym >= Bindings.size()) {
+      Bindings.resize(sym + 1);
+    }
+    auto &b = Bindings[sym];
+    if (b.ID && b.Depth == Marks.size()) {
+      return false;
+    }
+    Undo.push_back({sym, b});
+    b = {id, Marks.size()};
+    return true;
   }
 
-  void NextColumn() {
-    Pos++;
-    Col++;
+  std::optional<int> Lookup(Symbol sym) const {
+    if (sym >= Bindings.size() || !Bindings[sym].ID) {
+      return {};
+    }
+    return Bindings[sym].ID;
   }
 };
 
-struct Span {
-  Loc Start, End;
+enum class Resolution { OK, NotFound, Duplicate };
 
-  Span(Loc start, Loc end) : Start{start}, End{end} {}
-};
+// Top-level names of all modules in a compilation, consulted by text when a
+// name is not bound inside its own module. Filled in before any module is
+// resolved and only read afterwards, so resolvers share it without locking.
+//
+// A name of the same module is only found from definitions after its own, by
+// order within the module, for resolving one definition at a time.
+class Globals {
+  struct Entry {
+    int ID;
+    size_t Module, Order;
+  };
 
-// TODO: Use C++ style file stream.
-class Source {
-  Loc Loc{};
-  FILE *File;
-  [[maybe_unused]] IDs &IDs;
-  [[maybe_unused]] bool Failed{}, Atom{}, NewlineSensitive{};
+  std::unordered_map<std::string_view, Entry> Entries{};
 
 public:
-  Source(FILE *file, class IDs &ids) : File{file}, IDs{ids} {}
-
-  size_t Size() {
-    fseek(File, 0, SEEK_END);
-    auto size = ftell(File);
-    fseek(File, static_cast<long>(Loc.Pos), SEEK_SET);
-    return static_cast<size_t>(size);
-  }
-
-  Result<std::string> NewText(const Span &span) {
-    auto size = span.End.Pos - span.Start.Pos + 1;
-    std::string text{};
-    text.reserve(size);
-    fseek(File, static_cast<long>(span.Start.Pos), SEEK_SET);
-    if (auto p = fgets(text.data(), static_cast<int>(size), File); p) {
-      return {text};
-    }
-    return ::jian::Error("read text error"); // TODO
+  // Returns false if another module already defines this name.
+  bool Add(std::string_view name, int id, size_t module, size_t order = 0) {
+    auto [it, ok] = Entries.insert({name, {id, module, order}});
+    return ok || it->second.Module == module;
   }
 
-  std::optional<char> Peek() {
-    if (fseek(File, static_cast<long>(Loc.Pos), SEEK_SET) != 0) {
+  std::optional<int> Lookup(std::string_view name, size_t module,
+                            size_t order = 0) const {
+    auto it = Entries.find(name);
+    if (it == Entries.end() ||
+        (it->second.Module == module && it->second.Order >= order)) {
       return {};
     }
-    if (int c = fgetc(File); c != EOF) {
-      return static_cast<char>(c);
-    }
-    return {};
+    return it->second.ID;
   }
+};
 
-  std::optional<char> Next() {
-    auto next = Peek();
-    if (!next) {
-      return {};
-    }
-    auto c = next.value();
-    if (c == '\n') {
-      Loc.NextLine();
-    } else {
-      Loc.NextColumn();
+// A name looked up among the globals, with what it was bound to, 0 if
+// nothing.
+struct Use {
+  std::string_view Name;
+  int ID;
+};
+
+static inline const char *ToString(Resolution state) {
+  switch (state) {
+  case Resolution::OK:
+    return "resolved successfully";
+  case Resolution::NotFound:
+    return "variable not found";
+  case Resolution::Duplicate:
+    return "duplicate variable";
+  }
+  unreachable();
+}
+
+// Binds every reference to the ID of its definition. Globals of the same
+// module are visible from their own definition onwards, those of other modules
+// everywhere, and parameters only within their body.
+class Resolver {
+  const parsing::Symbols &Symbols;
+  const Globals *Externals;
+  size_t Module, Order{};
+  Scopes Scopes{};
+
+  bool bindParams(const Slice<parsing::Param> &params) {
+    for (auto &p : params) {
+      if (!Scopes.Bind(p.Sym, p.ID)) {
+        fail(Resolution::Duplicate, p.Name, p.Sym);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void fail(Resolution state, const parsing::Span &span, Symbol sym) {
+    State = state;
+    NameSpan = span;
+    NameText = Symbols.Name(sym);
+  }
+
+  void expr(parsing::Expr &e) {
+    using parsing::ExprKind;
+    switch (e.Kind) {
+    case ExprKind::App:
+      expr(e.Data.App->F);
+      for (auto &a : e.Data.App->Args) {
+        if (State != Resolution::OK) {
+          return;
+        }
+        expr(a);
+      }
+      return;
+    case ExprKind::Ite:
+      expr(e.Data.Ite->If);
+      if (State != Resolution::OK) {
+        return;
+      }
+      expr(e.Data.Ite->Then);
+      if (State != Resolution::OK) {
+        return;
+      }
+      expr(e.Data.Ite->Else);
+      return;
+    case ExprKind::Lam:
+      Scopes.Push();
+      if (bindParams(e.Data.Lam->Params)) {
+        expr(e.Data.Lam->Body);
+      }
+      Scopes.Pop();
+      return;
+    case ExprKind::Unresolved:
+      if (auto id = Scopes.Lookup(e.Data.Name)) {
+        e.Kind = ExprKind::Resolved;
+        e.Data.ID = *id;
+        return;
+      }
+      if (Externals) {
+        auto name = Symbols.Name(e.Data.Name);
+        auto id = Externals->Lookup(name, Module, Order);
+        Lookups++;
+        Uses.push_back({name, id ? *id : 0});
+        if (id) {
+          e.Kind = ExprKind::Resolved;
+          e.Data.ID = *id;
+          return;
+        }
+      }
+      fail(Resolution::NotFound, e.Span, e.Data.Name);
+      return;
+    case ExprKind::Num:
+    case ExprKind::Unit:
+    case ExprKind::False:
+    case ExprKind::True:
+      return;
+    case ExprKind::Resolved:
+      unreachable();
+    }
+  }
+
+  void def(parsing::Def &d) {
+    if (State != Resolution::OK) {
+      return;
+    }
+    if (!Scopes.Bind(d.Sym, d.ID)) {
+      fail(Resolution::Duplicate, d.Name, d.Sym);
+      return;
+    }
+    Scopes.Push();
+    if (bindParams(d.Params)) {
+      expr(d.Ret);
+    }
+    Scopes.Pop();
+  }
+
+public:
+  Resolution State{Resolution::OK};
+  parsing::Span NameSpan{};
+  std::string_view NameText{};
+  // Every lookup among the externals, in order.
+  std::vector<Use> Uses{};
+  // How many there were in all, for --stats.
+  size_t Lookups{};
+
+  explicit Resolver(const parsing::Symbols &symbols,
+                    const Globals *externals = nullptr, size_t module = 0)
+      : Symbols{symbols}, Externals{externals}, Module{module} {}
+
+  void Program(parsing::Program &p) {
+    for (auto &d : p.Defs) {
+      def(d);
+    }
+  }
+
+  // Resolves one definition on its own, as the given one of its module. No
+  // name of it stays bound for the next.
+  void Def(parsing::Def &d, size_t order) {
+    State = Resolution::OK;
+    Order = order;
+    Uses.clear();
+    Scopes.Push();
+    def(d);
+    Scopes.Pop();
+  }
+};
+
+} // namespace resolving
+
+namespace elab {
+
+using parsing::Expr;
+using parsing::ExprKind;
+
+enum class TermKind {
+  Univ = 1,
+
+  FnType,
+  NumType,
+  UnitType,
+  BoolType,
+  Meta,
+
+  Fn,
+  Num,
+  Unit,
+  False,
+  True,
+  Ite,
+  App,
+  Var,
+  Def,
+};
+
+struct Term;
+
+struct FnType {
+  Slice<Term *> Params;
+  Term *Ret;
+};
+
+struct Fn {
+  int ID;
+  Slice<int> Params;
+  Term *Body;
+};
+
+struct Ite {
+  Term *If, *Then, *Else;
+};
+
+struct App {
+  Term *F;
+  Slice<Term *> Args;
+};
+
+union TermData {
+  int64_t Num;
+  int ID;
+  struct FnType *FnType;
+  struct Fn *Fn;
+  struct Ite *Ite;
+  struct App *App;
+  // What a metavariable was solved with, null until then.
+  struct Term *Solution;
+};
+
+// Types and terms share one representation. Value terms carry their type, the
+// type of a type is Univ. A ground type has no metavariables in it.
+struct Term {
+  TermKind Kind;
+  bool Ground;
+  Term *Type;
+  TermData Data;
+};
+
+// Structurally equal terms are allocated once, so equal ground types are the
+// same pointer. Open addressing with linear probing over a power-of-two table,
+// keyed by kind, type and the immediate subterms, which are shared already.
+// Functions, each with their own ID, and metavariables, solved in place, are
+// never shared.
+//
+// Elaborators on several threads may share one table. It is split into shards
+// by hash, each with its own lock and its own arena for the terms it holds.
+// Those may still point into the arenas of the elaborators, which must live as
+// long as the table.
+class Table {
+  struct Shard {
+    std::mutex Lock{};
+    class Arena Arena{};
+    std::vector<Term *> Slots{};
+    size_t Count{}, Probes{};
+  };
+
+  std::array<Shard, 32> Shards{};
+
+  static size_t mix(size_t h, uintptr_t x) { return (h ^ x) * 1099511628211u; }
+
+  static size_t mix(size_t h, const Term *t) {
+    return mix(h, reinterpret_cast<uintptr_t>(t));
+  }
+
+  static size_t hash(const Term &t) {
+    auto h = mix(mix(14695981039346656037u, static_cast<uintptr_t>(t.Kind)),
+                 t.Type);
+    switch (t.Kind) {
+    case TermKind::FnType:
+      for (auto p : t.Data.FnType->Params) {
+        h = mix(h, p);
+      }
+      h = mix(h, t.Data.FnType->Ret);
+      break;
+    case TermKind::App:
+      h = mix(h, t.Data.App->F);
+      for (auto a : t.Data.App->Args) {
+        h = mix(h, a);
+      }
+      break;
+    case TermKind::Ite:
+      h = mix(mix(mix(h, t.Data.Ite->If), t.Data.Ite->Then), t.Data.Ite->Else);
+      break;
+    case TermKind::Num:
+      h = mix(h, static_cast<uintptr_t>(t.Data.Num));
+      break;
+    case TermKind::Var:
+    case TermKind::Def:
+      h = mix(h, static_cast<uintptr_t>(t.Data.ID));
+      break;
+    default:
+      break;
+    }
+    return h ^ h >> 32;
+  }
+
+  static bool same(const Slice<Term *> &a, const Slice<Term *> &b) {
+    return a.Size == b.Size && std::equal(a.begin(), a.end(), b.begin());
+  }
+
+  static bool same(const Term &a, const Term &b) {
+    if (a.Kind != b.Kind || a.Type != b.Type) {
+      return false;
+    }
+    switch (a.Kind) {
+    case TermKind::FnType:
+      return a.Data.FnType->Ret == b.Data.FnType->Ret &&
+             same(a.Data.FnType->Params, b.Data.FnType->Params);
+    case TermKind::App:
+      return a.Data.App->F == b.Data.App->F &&
+             same(a.Data.App->Args, b.Data.App->Args);
+    case TermKind::Ite:
+      return a.Data.Ite->If == b.Data.Ite->If &&
+             a.Data.Ite->Then == b.Data.Ite->Then &&
+             a.Data.Ite->Else == b.Data.Ite->Else;
+    case TermKind::Num:
+      return a.Data.Num == b.Data.Num;
+    case TermKind::Var:
+    case TermKind::Def:
+      return a.Data.ID == b.Data.ID;
+    default:
+      return true;
+    }
+  }
+
+  // The low bits of a hash pick the shard, the rest the slot in it.
+  static size_t slot(size_t h) { return h / 32; }
+
+  static void grow(Shard &s) {
+    std::vector<Term *> slots(std::max<size_t>(s.Slots.size() * 2, 64));
+    auto mask = slots.size() - 1;
+    for (auto t : s.Slots) {
+      if (!t) {
+        continue;
+      }
+      auto i = slot(hash(*t)) & mask;
+      while (slots[i]) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = t;
+    }
+    s.Slots.swap(slots);
+  }
+
+  size_t sum(size_t Shard::*field) const {
+    size_t n = 0;
+    for (auto &s : Shards) {
+      n += s.*field;
+    }
+    return n;
+  }
+
+public:
+  // The term equal to t, copied on first use along with the node its data
+  // points to. Slices in that node are kept as they are.
+  Term *Intern(Term t) {
+    auto h = hash(t);
+    auto &s = Shards[h % Shards.size()];
+    std::lock_guard<std::mutex> l{s.Lock};
+    if (s.Slots.empty()) {
+      grow(s);
+    }
+    auto mask = s.Slots.size() - 1;
+    auto i = slot(h) & mask;
+    for (; s.Slots[i]; i = (i + 1) & mask) {
+      s.Probes++;
+      if (same(*s.Slots[i], t)) {
+        return s.Slots[i];
+      }
+    }
+    switch (t.Kind) {
+    case TermKind::FnType: {
+      auto &f = *t.Data.FnType;
+      t.Ground = f.Ret->Ground &&
+                 std::all_of(f.Params.begin(), f.Params.end(),
+                             [](const Term *p) { return p->Ground; });
+      t.Data.FnType = s.Arena.New<FnType>(f);
+      break;
+    }
+    case TermKind::App:
+      t.Data.App = s.Arena.New<App>(*t.Data.App);
+      break;
+    case TermKind::Ite:
+      t.Data.Ite = s.Arena.New<Ite>(*t.Data.Ite);
+      break;
+    default:
+      t.Ground = !t.Type;
+      break;
+    }
+    auto p = s.Arena.New<Term>(t);
+    s.Slots[i] = p;
+    if (++s.Count * 2 > s.Slots.size()) {
+      grow(s);
+    }
+    return p;
+  }
+
+  // Totals over all shards, for when no one is interning.
+  size_t Size() const { return sum(&Shard::Count); }
+  size_t Probes() const { return sum(&Shard::Probes); }
+
+  size_t Allocations() const {
+    size_t n = 0;
+    for (auto &s : Shards) {
+      n += s.Arena.Allocations;
+    }
+    return n;
+  }
+};
+
+enum class ElabStateKind { OK, CheckFailed, InferFailed, TooLarge };
+
+struct ElabState {
+  ElabStateKind Kind{ElabStateKind::OK};
+  const Expr *Expr{};
+  Term *Got{}, *Expected{};
+};
+
+// A checked top-level definition, ready for code generation.
+struct Definition {
+  const parsing::Def *Def;
+  std::string_view Name;
+  Term *Type;
+  // A Fn for functions, the initializer for values.
+  Term *Body;
+  // Source line of each term in Body, recorded for the profiler. Terms are
+  // shared, so one written twice in a definition has the line of the first.
+  std::unordered_map<const Term *, uint32_t> Lines{};
+
+  // The line of t, or 0 if none was recorded.
+  uint32_t Line(const Term *t) const {
+    auto it = Lines.find(t);
+    return it == Lines.end() ? 0 : it->second;
+  }
+};
+
+// Bidirectional type checker. Unknown types, such as those of parameters, are
+// metavariables solved by unification.
+class Elab {
+  Arena &Arena;
+  parsing::IDs &IDs;
+  const parsing::Source *Src{};
+  // Line of the start of Src, which is not 1 for piped batches.
+  uint32_t FirstLine{1};
+  std::unordered_map<const Term *, uint32_t> Lines{};
+  Table &Table;
+  std::unordered_map<int, Term *> Types{};
+  std::unordered_map<int, const parsing::Def *> Globals{};
+
+  Term *value(TermKind kind, Term *type, TermData data = {}) {
+    return Table.Intern(Term{kind, false, type, data});
+  }
+
+  Term *UnivType = value(TermKind::Univ, nullptr);
+  Term *NumType = value(TermKind::NumType, nullptr);
+  Term *UnitType = value(TermKind::UnitType, nullptr);
+  Term *BoolType = value(TermKind::BoolType, nullptr);
+
+  Term *meta() {
+    return Arena.New<Term>(Term{TermKind::Meta, false, UnivType, {}});
+  }
+
+  Term *fnType(Slice<Term *> params, Term *ret) {
+    FnType f{params, ret};
+    TermData data{};
+    data.FnType = &f;
+    return value(TermKind::FnType, UnivType, data);
+  }
+
+  Term *fn(Term *type, int id, Slice<int> params, Term *body) {
+    auto t = Arena.New<Term>(Term{TermKind::Fn, false, type, {}});
+    t->Data.Fn = Arena.New<Fn>(id, params, body);
+    return t;
+  }
+
+  Slice<Term *> metas(size_t n) {
+    Slice<Term *> xs{Arena.NewArray<Term *>(n), n};
+    for (auto &x : xs) {
+      x = meta();
+    }
+    return xs;
+  }
+
+  bool occurs(Term *m, Term *t) {
+    t = Force(t);
+    if (t->Ground) {
+      return false;
+    }
+    switch (t->Kind) {
+    case TermKind::Meta:
+      return t == m;
+    case TermKind::FnType:
+      for (auto p : t->Data.FnType->Params) {
+        if (occurs(m, p)) {
+          return true;
+        }
+      }
+      return occurs(m, t->Data.FnType->Ret);
+    default:
+      return false;
+    }
+  }
+
+  bool unify(Term *a, Term *b) {
+    a = Force(a);
+    b = Force(b);
+    if (a == b) {
+      return true;
+    }
+    if (a->Kind == TermKind::Meta) {
+      if (occurs(a, b)) {
+        return false;
+      }
+      a->Data.Solution = b;
+      return true;
+    }
+    if (b->Kind == TermKind::Meta) {
+      return unify(b, a);
+    }
+    // Ground types are shared, so two of them differ if their pointers do.
+    if ((a->Ground && b->Ground) || a->Kind != b->Kind) {
+      return false;
+    }
+    if (a->Kind != TermKind::FnType) {
+      return true;
+    }
+    auto &x = *a->Data.FnType, &y = *b->Data.FnType;
+    if (x.Params.Size != y.Params.Size) {
+      return false;
+    }
+    for (size_t i = 0; i < x.Params.Size; i++) {
+      if (!unify(x.Params[i], y.Params[i])) {
+        return false;
+      }
+    }
+    return unify(x.Ret, y.Ret);
+  }
+
+  Term *located(size_t offset, Term *t) {
+    if (Locate) {
+      Lines.emplace(t, FirstLine - 1 +
+                           static_cast<uint32_t>(Src->LocOf(offset).Ln));
+    }
+    return t;
+  }
+
+  Term *fail(ElabStateKind kind, const Expr &e, Term *got, Term *expected) {
+    if (State.Kind == ElabStateKind::OK) {
+      State = {kind, &e, got, expected};
+    }
+    return value(TermKind::Unit, UnitType);
+  }
+
+  Term *number(const Expr &e) {
+    int64_t n = 0;
+    for (auto c : Src->Text(e.Span)) {
+      if (c == '_') {
+        continue;
+      }
+      if (n > (INT64_MAX - (c - '0')) / 10) {
+        return fail(ElabStateKind::TooLarge, e, nullptr, nullptr);
+      }
+      n = n * 10 + (c - '0');
+    }
+    TermData data{};
+    data.Num = n;
+    return value(TermKind::Num, NumType, data);
+  }
+
+  Term *lambda(const parsing::Lambda &lam, Slice<Term *> paramTypes,
+               Term *ret) {
+    Slice<int> ids{Arena.NewArray<int>(lam.Params.Size), lam.Params.Size};
+    for (size_t i = 0; i < lam.Params.Size; i++) {
+      ids[i] = lam.Params[i].ID;
+      Types[ids[i]] = paramTypes[i];
+    }
+    auto body = Check(lam.Body, ret);
+    return fn(fnType(paramTypes, ret), IDs.New(), ids, body);
+  }
+
+  Term *infer(const Expr &e) {
+    switch (e.Kind) {
+    case ExprKind::App: {
+      auto &a = *e.Data.App;
+      auto f = Infer(a.F);
+      auto fty = Force(f->Type);
+      if (fty->Kind == TermKind::Meta) {
+        auto guess = fnType(metas(a.Args.Size), meta());
+        unify(fty, guess);
+        fty = guess;
+      }
+      if (fty->Kind != TermKind::FnType ||
+          fty->Data.FnType->Params.Size != a.Args.Size) {
+        Slice<Term *> params{Arena.NewArray<Term *>(a.Args.Size),
+                             a.Args.Size};
+        for (size_t i = 0; i < a.Args.Size; i++) {
+          params[i] = Infer(a.Args[i])->Type;
+        }
+        return fail(ElabStateKind::InferFailed, a.F, f->Type,
+                    fnType(params, meta()));
+      }
+      Slice<Term *> args{Arena.NewArray<Term *>(a.Args.Size), a.Args.Size};
+      for (size_t i = 0; i < a.Args.Size; i++) {
+        args[i] = Check(a.Args[i], fty->Data.FnType->Params[i]);
+      }
+      App app{f, args};
+      TermData data{};
+      data.App = &app;
+      return value(TermKind::App, fty->Data.FnType->Ret, data);
+    }
+    case ExprKind::Ite: {
+      auto &ite = *e.Data.Ite;
+      auto i = Check(ite.If, BoolType);
+      auto th = Infer(ite.Then);
+      auto el = Check(ite.Else, th->Type);
+      Ite node{i, th, el};
+      TermData data{};
+      data.Ite = &node;
+      return value(TermKind::Ite, th->Type, data);
+    }
+    case ExprKind::Lam:
+      return lambda(*e.Data.Lam, metas(e.Data.Lam->Params.Size), meta());
+    case ExprKind::Num:
+      return number(e);
+    case ExprKind::Unit:
+      return value(TermKind::Unit, UnitType);
+    case ExprKind::False:
+      return value(TermKind::False, BoolType);
+    case ExprKind::True:
+      return value(TermKind::True, BoolType);
+    case ExprKind::Resolved: {
+      auto it = Types.find(e.Data.ID);
+      if (it == Types.end()) {
+        unreachable();
+      }
+      auto kind = Globals.count(e.Data.ID) ? TermKind::Def : TermKind::Var;
+      TermData data{};
+      data.ID = e.Data.ID;
+      return value(kind, it->second, data);
+    }
+    case ExprKind::Unresolved:
+      break;
+    }
+    unreachable();
+  }
+
+public:
+  ElabState State{};
+  // Records the line of every term checked, into its definition. Piped
+  // batches must give their first line, and modules checked in parallel must
+  // have had their lines computed.
+  bool Locate{};
+
+  Elab(class Arena &arena, parsing::IDs &ids, class Table &table)
+      : Arena{arena}, IDs{ids}, Table{table} {}
+
+  // Source of the definitions checked next, for literal text and lines.
+  void Module(const parsing::Source &src, uint32_t line = 1) {
+    Src = &src;
+    FirstLine = line;
+  }
+
+  // Follows solved metavariables at the head of a term, and points every one
+  // passed straight at where they lead.
+  Term *Force(Term *t) {
+    auto end = t;
+    while (end->Kind == TermKind::Meta && end->Data.Solution) {
+      end = end->Data.Solution;
+    }
+    while (t != end) {
+      auto next = t->Data.Solution;
+      t->Data.Solution = end;
+      t = next;
+    }
+    return end;
+  }
+
+  // Substitutes solved metavariables everywhere in a type, which makes it
+  // ground. Unsolved ones are never constrained by the program, so they
+  // default to unit.
+  Term *Zonk(Term *t) {
+    t = Force(t);
+    if (t->Ground) {
+      return t;
+    }
+    switch (t->Kind) {
+    case TermKind::Meta:
+      t->Data.Solution = UnitType;
+      return UnitType;
+    case TermKind::FnType: {
+      auto &f = *t->Data.FnType;
+      Slice<Term *> params{Arena.NewArray<Term *>(f.Params.Size),
+                           f.Params.Size};
+      for (size_t i = 0; i < f.Params.Size; i++) {
+        params[i] = Zonk(f.Params[i]);
+      }
+      return fnType(params, Zonk(f.Ret));
+    }
+    default:
+      return t;
+    }
+  }
+
+  Term *Check(const Expr &e, Term *ty) {
+    auto fty = Force(ty);
+    if (e.Kind == ExprKind::Lam && fty->Kind == TermKind::FnType &&
+        fty->Data.FnType->Params.Size == e.Data.Lam->Params.Size) {
+      return located(e.Span.Start, lambda(*e.Data.Lam, fty->Data.FnType->Params,
+                                          fty->Data.FnType->Ret));
+    }
+    auto t = Infer(e);
+    if (State.Kind == ElabStateKind::OK && !unify(t->Type, ty)) {
+      return fail(ElabStateKind::CheckFailed, e, t->Type, ty);
+    }
+    return t;
+  }
+
+  Term *Infer(const Expr &e) { return located(e.Span.Start, infer(e)); }
+
+  // Gives a definition its provisional type, so that references from any
+  // module may be checked before its body is.
+  void Declare(const parsing::Def &d) {
+    Globals[d.ID] = &d;
+    Types[d.ID] = d.Kind == parsing::DefKind::Fn
+                      ? fnType(metas(d.Params.Size), meta())
+                      : meta();
+  }
+
+  Definition Define(const parsing::Def &d) {
+    auto ty = Types[d.ID];
+    Lines.clear();
+    if (d.Kind == parsing::DefKind::Val) {
+      auto body = Check(d.Ret, ty);
+      return {&d, Src->Text(d.Name), ty, body, std::move(Lines)};
+    }
+    auto &f = *Force(ty)->Data.FnType;
+    Slice<int> ids{Arena.NewArray<int>(d.Params.Size), d.Params.Size};
+    for (size_t i = 0; i < d.Params.Size; i++) {
+      ids[i] = d.Params[i].ID;
+      Types[ids[i]] = f.Params[i];
+    }
+    auto body = located(d.Name.Start, fn(ty, d.ID, ids, Check(d.Ret, f.Ret)));
+    return {&d, Src->Text(d.Name), ty, body, std::move(Lines)};
+  }
+
+  // Type of what running a definition produces, the return type for
+  // functions.
+  Term *Result(const Definition &d) {
+    auto ty = Zonk(d.Type);
+    return d.Def->Kind == parsing::DefKind::Fn ? ty->Data.FnType->Ret : ty;
+  }
+
+  std::string ToString(Term *t) {
+    t = Force(t);
+    switch (t->Kind) {
+    case TermKind::NumType:
+      return "Num";
+    case TermKind::UnitType:
+      return "Unit";
+    case TermKind::BoolType:
+      return "Bool";
+    case TermKind::Meta:
+      return "?";
+    case TermKind::FnType: {
+      std::string s{"("};
+      auto &f = *t->Data.FnType;
+      for (size_t i = 0; i < f.Params.Size; i++) {
+        s += (i ? ", " : "") + ToString(f.Params[i]);
+      }
+      return s + ") => " + ToString(f.Ret);
+    }
+    default:
+      return "?";
+    }
+  }
+};
+
+// Variables t uses that are not in bound, each once in order of first use:
+// what a lambda captures.
+static inline void Captures(Term *t, std::vector<int> &bound,
+                            std::vector<Term *> &out) {
+  switch (t->Kind) {
+  case TermKind::Var: {
+    auto id = t->Data.ID;
+    if (std::find(bound.begin(), bound.end(), id) == bound.end() &&
+        std::none_of(out.begin(), out.end(),
+                     [id](Term *v) { return v->Data.ID == id; })) {
+      out.push_back(t);
+    }
+    return;
+  }
+  case TermKind::Fn: {
+    auto &f = *t->Data.Fn;
+    auto n = bound.size();
+    bound.insert(bound.end(), f.Params.begin(), f.Params.end());
+    Captures(f.Body, bound, out);
+    bound.resize(n);
+    return;
+  }
+  case TermKind::Ite:
+    Captures(t->Data.Ite->If, bound, out);
+    Captures(t->Data.Ite->Then, bound, out);
+    Captures(t->Data.Ite->Else, bound, out);
+    return;
+  case TermKind::App:
+    Captures(t->Data.App->F, bound, out);
+    for (auto arg : t->Data.App->Args) {
+      Captures(arg, bound, out);
+    }
+    return;
+  default:
+    return;
+  }
+}
+
+// The order values are initialized in, so that nothing is read before it is
+// set: values may refer to ones defined later, in any module. A value reads
+// what its initializer refers to, and through the functions it refers to
+// whatever they do. What a lambda refers to is only read once it is called,
+// which initialization may or may not do, so it orders values without
+// closing a cycle; a cycle of reads has no order.
+class Initialization {
+  std::unordered_map<int, const Definition *> Defs{};
+  std::unordered_map<int, size_t> Position{};
+  // For the values on the path being visited, and whether each reads the
+  // next one outside of a lambda.
+  std::vector<int> Path{};
+  std::vector<bool> Direct{};
+  std::unordered_map<int, bool> Done{};
+
+  // Values t refers to, true if read outside of a lambda, through functions.
+  void reads(Term *t, bool direct, std::unordered_map<int, bool> &values,
+             std::unordered_map<int, bool> &fns) const {
+    switch (t->Kind) {
+    case TermKind::Fn:
+      reads(t->Data.Fn->Body, false, values, fns);
+      break;
+    case TermKind::Ite:
+      reads(t->Data.Ite->If, direct, values, fns);
+      reads(t->Data.Ite->Then, direct, values, fns);
+      reads(t->Data.Ite->Else, direct, values, fns);
+      break;
+    case TermKind::App:
+      // A lambda applied right away runs now.
+      reads(t->Data.App->F->Kind == TermKind::Fn ? t->Data.App->F->Data.Fn->Body
+                                                  : t->Data.App->F,
+            direct, values, fns);
+      for (auto a : t->Data.App->Args) {
+        reads(a, direct, values, fns);
+      }
+      break;
+    case TermKind::Def: {
+      auto it = Defs.find(t->Data.ID);
+      if (it == Defs.end()) {
+        break;
+      }
+      auto d = it->second;
+      if (d->Def->Kind == parsing::DefKind::Val) {
+        values[d->Def->ID] |= direct;
+        break;
+      }
+      auto seen = fns.find(d->Def->ID);
+      if (seen != fns.end() && (seen->second || !direct)) {
+        break;
+      }
+      fns[d->Def->ID] = direct;
+      reads(d->Body->Data.Fn->Body, direct, values, fns);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  const Definition *visit(const Definition &d,
+                          std::vector<const Definition *> &order) {
+    Done[d.Def->ID] = false;
+    Path.push_back(d.Def->ID);
+    std::unordered_map<int, bool> values{}, fns{};
+    reads(d.Body, true, values, fns);
+    // In definition order, so that independent values keep it.
+    std::vector<std::pair<int, bool>> sorted{values.begin(), values.end()};
+    std::sort(sorted.begin(), sorted.end(), [&](auto &a, auto &b) {
+      return Position.at(a.first) < Position.at(b.first);
+    });
+    for (auto [id, direct] : sorted) {
+      auto it = Done.find(id);
+      if (it == Done.end()) {
+        Direct.push_back(direct);
+        if (auto cycle = visit(*Defs.at(id), order)) {
+          return cycle;
+        }
+        Direct.pop_back();
+      } else if (!it->second && direct) {
+        auto at = std::find(Path.begin(), Path.end(), id) - Path.begin();
+        if (std::all_of(Direct.begin() + at, Direct.end(),
+                        [](bool b) { return b; })) {
+          return Defs.at(id);
+        }
+      }
+    }
+    Path.pop_back();
+    Done[d.Def->ID] = true;
+    order.push_back(&d);
+    return nullptr;
+  }
+
+public:
+  explicit Initialization(const std::vector<const Definition *> &defs) {
+    for (auto d : defs) {
+      Position[d->Def->ID] = Defs.size();
+      Defs[d->Def->ID] = d;
+    }
+  }
+
+  // What both backends report for a value that reads itself.
+  static std::string Cycle(const Definition &d) {
+    return "initialization of " + std::string{d.Name} + " reads itself";
+  }
+
+  // The values of defs in order, or null. Otherwise the value that reads
+  // itself, with order unspecified.
+  const Definition *Order(const std::vector<const Definition *> &defs,
+                          std::vector<const Definition *> &order) {
+    for (auto d : defs) {
+      if (d->Def->Kind == parsing::DefKind::Val && !Done.count(d->Def->ID)) {
+        if (auto cycle = visit(*d, order)) {
+          return cycle;
+        }
+      }
+    }
+    return nullptr;
+  }
+};
+
+// The definitions root refers to, itself included, directly or through
+// others, in the order of defs. What a lambda refers to counts, since it may
+// be called.
+static inline std::vector<Definition>
+Reachable(const std::vector<Definition> &defs, const Definition &root) {
+  std::unordered_map<int, const Definition *> byID{};
+  for (auto &d : defs) {
+    byID[d.Def->ID] = &d;
+  }
+  std::unordered_set<int> seen{root.Def->ID};
+  std::vector<Term *> work{root.Body};
+  while (!work.empty()) {
+    auto t = work.back();
+    work.pop_back();
+    switch (t->Kind) {
+    case TermKind::Fn:
+      work.push_back(t->Data.Fn->Body);
+      break;
+    case TermKind::Ite:
+      work.push_back(t->Data.Ite->If);
+      work.push_back(t->Data.Ite->Then);
+      work.push_back(t->Data.Ite->Else);
+      break;
+    case TermKind::App:
+      work.push_back(t->Data.App->F);
+      work.insert(work.end(), t->Data.App->Args.begin(),
+                  t->Data.App->Args.end());
+      break;
+    case TermKind::Def: {
+      auto it = byID.find(t->Data.ID);
+      if (it != byID.end() && seen.insert(t->Data.ID).second) {
+        work.push_back(it->second->Body);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  std::vector<Definition> out{};
+  for (auto &d : defs) {
+    if (seen.count(d.Def->ID)) {
+      out.push_back(d);
+    }
+  }
+  return out;
+}
+
+} // namespace elab
+
+namespace codegen {
+
+using elab::Term;
+using elab::TermKind;
+
+// Initializes all values, then runs main.
+static inline long long start(void *init, void *main) {
+  using Init = void (*)();
+  using Main = long long (*)();
+  reinterpret_cast<Init>(init)();
+  return reinterpret_cast<Main>(main)();
+}
+
+// Functions gccjit compiled in memory. Their object file is deleted once
+// loaded, so perf and backtraces only see anonymous addresses. Every function
+// is kept here by symbol and by the elab::Fn it came from, if any, for the
+// profiler. Once enabled, each is also appended to /tmp/perf-<pid>.map, where
+// perf looks for such symbols.
+class CodeMap {
+public:
+  struct Range {
+    uintptr_t Start;
+    size_t Size;
+    std::string Symbol;
+    const elab::Fn *Fn;
+    // Where the function is written, or 0. Code inside it is not told apart.
+    uint32_t Line;
+  };
+
+private:
+  std::mutex Lock{};
+  std::vector<Range> Ranges{};
+  FILE *Perf{};
+
+  void write(const Range &r) {
+    fprintf(Perf, "%lx %zx %s\n", static_cast<unsigned long>(r.Start), r.Size,
+            r.Symbol.c_str());
+    fflush(Perf);
+  }
+
+public:
+  // Never destroyed, the compiler thread of a machine may add to it late.
+  static CodeMap &Get() {
+    static auto map = new CodeMap{};
+    return *map;
+  }
+
+  // Whether the map file could be opened.
+  bool WritePerfMap() {
+    std::lock_guard<std::mutex> lock{Lock};
+    if (Perf) {
+      return true;
+    }
+    auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    Perf = fopen(path.c_str(), "a");
+    if (!Perf) {
+      return false;
+    }
+    for (auto &r : Ranges) {
+      write(r);
+    }
+    return true;
+  }
+
+  // Sizes come from the symbol table of the object gccjit loaded, which the
+  // C library only exposes on glibc. Elsewhere functions have no extent and
+  // are never found.
+  void Add(const void *code, std::string symbol, const elab::Fn *fn,
+           uint32_t line = 0) {
+    if (!code) {
+      return;
+    }
+    size_t size = 0;
+#ifdef __GLIBC__
+    Dl_info info{};
+    void *sym = nullptr;
+    if (dladdr1(code, &info, &sym, RTLD_DL_SYMENT) && sym) {
+      size = static_cast<const ElfW(Sym) *>(sym)->st_size;
+    }
+#endif
+    std::lock_guard<std::mutex> lock{Lock};
+    Ranges.push_back(
+        {reinterpret_cast<uintptr_t>(code), size, std::move(symbol), fn, line});
+    if (Perf) {
+      write(Ranges.back());
+    }
+  }
+
+  // The function pc is in, copied since the compiler thread may still add.
+  std::optional<Range> Find(uintptr_t pc) {
+    std::lock_guard<std::mutex> lock{Lock};
+    for (auto &r : Ranges) {
+      if (pc >= r.Start && pc - r.Start < r.Size) {
+        return r;
+      }
+    }
+    return std::nullopt;
+  }
+};
+
+// Lowers checked definitions into one gccjit context. Numbers become long
+// long, booleans bool and unit int. Definitions are plain functions, called
+// directly; a function as a value is a pointer to its closure, a struct of
+// code taking the closure first. Only closures that capture nothing are
+// supported: they are shared and set up by jian_init. One that captures would
+// have to be allocated per call, and neither executables nor the cache link
+// the collector that could free it, so such lambdas fail the build. Values are initialized in
+// dependency order by jian_init, and jian_main returns the value of main.
+class JIT {
+  gccjit::context Ctx;
+  elab::Elab &Elab;
+  gcc_jit_result *Result{};
+  gccjit::type VoidPtr;
+  gccjit::function SetupFn;
+  gccjit::block Setup;
+  // Code types by zonked function type, which is shared.
+  std::unordered_map<Term *, gccjit::type> FnTypes{};
+  std::unordered_map<int, gccjit::function> Fns{};
+  std::unordered_map<int, gccjit::lvalue> Vals{};
+  std::unordered_map<int, gccjit::rvalue> Locals{};
+  // Shared closures of definitions used as values, by ID.
+  std::unordered_map<int, gccjit::rvalue> Shared{};
+  std::vector<const elab::Definition *> Defs{};
+  const elab::Definition *Main{};
+  gccjit::function InitFn{}, MainFn{};
+  int Level, Temps{};
+  // The definition being emitted, to name it in errors and find lines.
+  const elab::Definition *Current{};
+  // Functions that can be looked up once compiled, with what they came from.
+  struct Export {
+    std::string Symbol;
+    const elab::Fn *Fn;
+    uint32_t Line;
+  };
+  std::vector<Export> Exports{};
+
+  // Small bodies without calls or lambdas are always inlined once optimizing.
+  // Anything else is left to gcc, which sees all definitions at once since
+  // they are internal to one context.
+  static bool inlinable(Term *t, int &budget) {
+    if (--budget < 0) {
+      return false;
+    }
+    switch (t->Kind) {
+    case TermKind::Ite:
+      return inlinable(t->Data.Ite->If, budget) &&
+             inlinable(t->Data.Ite->Then, budget) &&
+             inlinable(t->Data.Ite->Else, budget);
+    case TermKind::Fn:
+    case TermKind::App:
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  gccjit::type lower(Term *ty) {
+    ty = Elab.Zonk(ty);
+    switch (ty->Kind) {
+    case TermKind::NumType:
+      return Ctx.get_type(GCC_JIT_TYPE_LONG_LONG);
+    case TermKind::BoolType:
+      return Ctx.get_type(GCC_JIT_TYPE_BOOL);
+    case TermKind::UnitType:
+      return Ctx.get_type(GCC_JIT_TYPE_INT);
+    case TermKind::FnType:
+      return VoidPtr;
+    default:
+      unreachable();
+    }
+  }
+
+  // The code in a closure of function type ty.
+  gccjit::type code(Term *ty) {
+    ty = Elab.Zonk(ty);
+    auto it = FnTypes.find(ty);
+    if (it != FnTypes.end()) {
+      return it->second;
+    }
+    auto &f = *ty->Data.FnType;
+    std::vector<gcc_jit_type *> params{VoidPtr.get_inner_type()};
+    for (auto p : f.Params) {
+      params.push_back(lower(p).get_inner_type());
+    }
+    gccjit::type t{gcc_jit_context_new_function_ptr_type(
+        Ctx.get_inner_context(), nullptr, lower(f.Ret).get_inner_type(),
+        static_cast<int>(params.size()), params.data(), 0)};
+    FnTypes.emplace(ty, t);
+    return t;
+  }
+
+  // Closure code takes its closure before the parameters. Line is where fn
+  // is written, for the profiler.
+  gccjit::function function(std::string_view name, const elab::Fn &fn,
+                            Term *ty, uint32_t line,
+                            enum gcc_jit_function_kind kind,
+                            bool closure = false) {
+    auto &f = *Elab.Zonk(ty)->Data.FnType;
+    std::vector<gccjit::param> params{};
+    if (closure) {
+      params.push_back(Ctx.new_param(VoidPtr, "self"));
+    }
+    for (size_t i = 0; i < fn.Params.Size; i++) {
+      params.push_back(Ctx.new_param(lower(f.Params[i]),
+                                     'v' + std::to_string(fn.Params[i])));
+    }
+    auto symbol = "jian_" + std::string{name} + '_' + std::to_string(fn.ID);
+    if (Visible && kind == GCC_JIT_FUNCTION_INTERNAL) {
+      kind = GCC_JIT_FUNCTION_EXPORTED;
+      Exports.push_back({symbol, &fn, line});
+    }
+    return Ctx.new_function(kind, lower(f.Ret), symbol, params, 0);
+  }
+
+  gccjit::rvalue address(gccjit::function f, Term *ty) {
+    return Ctx.new_cast(
+        gccjit::rvalue{gcc_jit_function_get_address(f.get_inner_function(),
+                                                    nullptr)},
+        code(ty));
+  }
+
+  // A closure of code that captures nothing, one for all uses.
+  gccjit::rvalue shared(gccjit::function f, Term *ty, const std::string &name) {
+    std::vector<gccjit::field> fields{Ctx.new_field(code(ty), "code")};
+    auto type = Ctx.new_struct_type(name + "_closure", fields);
+    auto global =
+        Ctx.new_global(GCC_JIT_GLOBAL_INTERNAL, type, name + "_closure");
+    Setup.add_assignment(global.access_field(fields[0]), address(f, ty));
+    return Ctx.new_cast(global.get_address(), VoidPtr);
+  }
+
+  // Definition id as a value: code that calls it, in a shared closure.
+  gccjit::rvalue value(int id) {
+    auto it = Shared.find(id);
+    if (it != Shared.end()) {
+      return it->second;
+    }
+    auto d = *std::find_if(Defs.begin(), Defs.end(), [id](auto def) {
+      return def->Def->ID == id;
+    });
+    auto &fn = *d->Body->Data.Fn;
+    auto name = std::string{d->Name} + "_value";
+    auto f = function(name, fn, d->Type, d->Line(d->Body),
+                      GCC_JIT_FUNCTION_INTERNAL, true);
+    std::vector<gccjit::rvalue> args{};
+    for (size_t i = 0; i < fn.Params.Size; i++) {
+      args.push_back(f.get_param(static_cast<int>(i + 1)));
+    }
+    f.new_block().end_with_return(Ctx.new_call(Fns.at(id), args));
+    auto v = shared(f, d->Type, "jian_" + name + '_' + std::to_string(id));
+    Shared.emplace(id, v);
+    return v;
+  }
+
+  void body(gccjit::function f, const elab::Fn &fn, bool closure = false) {
+    auto saved = std::move(Locals);
+    Locals = {};
+    auto first = closure ? 1 : 0;
+    for (size_t i = 0; i < fn.Params.Size; i++) {
+      Locals[fn.Params[i]] = f.get_param(first + static_cast<int>(i));
+    }
+    auto b = f.new_block();
+    auto v = expr(f, b, fn.Body);
+    b.end_with_return(v);
+    Locals = std::move(saved);
+  }
+
+  // The shared closure of lambda t, which must capture nothing.
+  gccjit::rvalue lambda(Term *t) {
+    auto &fn = *t->Data.Fn;
+    std::vector<int> bound{};
+    std::vector<Term *> captured{};
+    elab::Captures(t, bound, captured);
+    if (!captured.empty()) {
+      Closures = true;
+      fail("a lambda in " + std::string{Current->Name} +
+           " captures variables, and compiled code has no collector to free "
+           "its closure");
+      return Ctx.null(VoidPtr);
+    }
+    auto lam = function("lambda", fn, t->Type, Current->Line(t),
+                        GCC_JIT_FUNCTION_INTERNAL, true);
+    body(lam, fn, true);
+    return shared(lam, t->Type, "jian_lambda_" + std::to_string(fn.ID));
+  }
+
+  // Emits t into b, which is moved to the join block of any conditional.
+  gccjit::rvalue expr(gccjit::function f, gccjit::block &b, Term *t) {
+    switch (t->Kind) {
+    case TermKind::Fn:
+      return lambda(t);
+    case TermKind::Num:
+      return Ctx.new_rvalue(lower(t->Type), static_cast<long>(t->Data.Num));
+    case TermKind::Unit:
+    case TermKind::False:
+      return Ctx.zero(lower(t->Type));
+    case TermKind::True:
+      return Ctx.one(lower(t->Type));
+    case TermKind::Ite: {
+      auto &ite = *t->Data.Ite;
+      auto cond = expr(f, b, ite.If);
+      auto res = f.new_local(lower(t->Type), 't' + std::to_string(Temps++));
+      auto then = f.new_block(), els = f.new_block(), join = f.new_block();
+      b.end_with_conditional(cond, then, els);
+      then.add_assignment(res, expr(f, then, ite.Then));
+      then.end_with_jump(join);
+      els.add_assignment(res, expr(f, els, ite.Else));
+      els.end_with_jump(join);
+      b = join;
+      return res;
+    }
+    case TermKind::App: {
+      auto &a = *t->Data.App;
+      std::vector<gccjit::rvalue> args{};
+      for (auto arg : a.Args) {
+        args.push_back(expr(f, b, arg));
+      }
+      if (a.F->Kind == TermKind::Def) {
+        auto it = Fns.find(a.F->Data.ID);
+        if (it != Fns.end()) {
+          return Ctx.new_call(it->second, args);
+        }
+      }
+      // The closure is passed to its own code, so it is evaluated once.
+      auto self = f.new_local(VoidPtr, 't' + std::to_string(Temps++));
+      b.add_assignment(self, expr(f, b, a.F));
+      auto callee =
+          Ctx.new_cast(self, code(a.F->Type).get_pointer()).dereference();
+      std::vector<gcc_jit_rvalue *> raw{self.get_inner_rvalue()};
+      for (auto &arg : args) {
+        raw.push_back(arg.get_inner_rvalue());
+      }
+      return gccjit::rvalue{gcc_jit_context_new_call_through_ptr(
+          Ctx.get_inner_context(), nullptr, callee.get_inner_rvalue(),
+          static_cast<int>(raw.size()), raw.data())};
+    }
+    case TermKind::Var:
+      return Locals.at(t->Data.ID);
+    case TermKind::Def:
+      if (Fns.count(t->Data.ID)) {
+        return value(t->Data.ID);
+      }
+      return Vals.at(t->Data.ID);
+    default:
+      unreachable();
+    }
+  }
+
+  void fail(const std::string &msg) {
+    if (Error.empty()) {
+      Error = msg;
+    }
+  }
+
+public:
+  std::string Error{};
+  // Exports every function that is not inlined, so that the profiler and
+  // perf can name them, at the cost of keeping unused ones. Set before
+  // declaring anything.
+  bool Visible{};
+  // Set once a lambda that captures fails the build; the bytecode machine,
+  // whose closures are collected, can still run the program.
+  bool Closures{};
+
+  explicit JIT(elab::Elab &elab, int level = 0)
+      : Ctx{gccjit::context::acquire()}, Elab{elab},
+        VoidPtr{Ctx.get_type(GCC_JIT_TYPE_VOID_PTR)}, Level{level} {
+    Ctx.set_int_option(GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL, level);
+    std::vector<gccjit::param> none{};
+    SetupFn = Ctx.new_function(GCC_JIT_FUNCTION_INTERNAL,
+                               Ctx.get_type(GCC_JIT_TYPE_VOID),
+                               "jian_closures", none, 0);
+    Setup = SetupFn.new_block();
+  }
+
+  JIT(const JIT &) = delete;
+  JIT &operator=(const JIT &) = delete;
+
+  ~JIT() {
+    if (Result) {
+      gcc_jit_result_release(Result);
+    } else {
+      Ctx.release();
+    }
+  }
+
+  void Declare(const elab::Definition &d) {
+    auto id = d.Def->ID;
+    if (d.Def->Kind == parsing::DefKind::Fn) {
+      int budget = 32;
+      Fns[id] = function(d.Name, *d.Body->Data.Fn, d.Type, d.Line(d.Body),
+                         Level > 0 && inlinable(d.Body->Data.Fn->Body, budget)
+                             ? GCC_JIT_FUNCTION_ALWAYS_INLINE
+                             : GCC_JIT_FUNCTION_INTERNAL);
+    } else {
+      Vals[id] = Ctx.new_global(GCC_JIT_GLOBAL_INTERNAL, lower(d.Type),
+                                "jian_" + std::string{d.Name} + '_' +
+                                    std::to_string(id));
+    }
+    Defs.push_back(&d);
+    if (d.Name == "main") {
+      Main = &d;
+    }
+  }
+
+  void Define(const elab::Definition &d) {
+    Current = &d;
+    if (d.Def->Kind == parsing::DefKind::Fn) {
+      body(Fns.at(d.Def->ID), *d.Body->Data.Fn);
+    }
+  }
+
+  // Emits the entry points. Definitions must all have been added.
+  bool Build() {
+    std::vector<gccjit::param> none{};
+    InitFn = Ctx.new_function(GCC_JIT_FUNCTION_EXPORTED,
+                              Ctx.get_type(GCC_JIT_TYPE_VOID), "jian_init",
+                              none, 0);
+    auto b = InitFn.new_block();
+    b.add_eval(Ctx.new_call(SetupFn));
+    std::vector<const elab::Definition *> inits{};
+    if (auto cycle = elab::Initialization{Defs}.Order(Defs, inits)) {
+      fail(elab::Initialization::Cycle(*cycle));
+    }
+    for (auto d : inits) {
+      Current = d;
+      auto v = expr(InitFn, b, d->Body);
+      b.add_assignment(Vals.at(d->Def->ID), v);
+    }
+    b.end_with_return();
+
+    auto ll = Ctx.get_type(GCC_JIT_TYPE_LONG_LONG);
+    MainFn = Ctx.new_function(GCC_JIT_FUNCTION_EXPORTED, ll, "jian_main",
+                              none, 0);
+    b = MainFn.new_block();
+    if (!Main) {
+      b.end_with_return(Ctx.zero(ll));
+    } else if (Main->Def->Kind == parsing::DefKind::Fn &&
+               Main->Def->Params.Size != 0) {
+      fail("main must not take parameters");
+      b.end_with_return(Ctx.zero(ll));
+    } else {
+      gccjit::rvalue v = Main->Def->Kind == parsing::DefKind::Fn
+                             ? Ctx.new_call(Fns.at(Main->Def->ID))
+                             : Vals.at(Main->Def->ID);
+      if (Elab.Result(*Main)->Kind == TermKind::FnType) {
+        b.add_eval(v);
+        v = Ctx.zero(ll);
+      }
+      b.end_with_return(Ctx.new_cast(v, ll));
+    }
+    Setup.end_with_return();
+    return Error.empty();
+  }
+
+  // Adds a C main that prints the value of main, for standalone executables.
+  void Executable(elab::TermKind result) {
+    auto i = Ctx.get_type(GCC_JIT_TYPE_INT);
+    std::vector<gccjit::param> none{},
+        format{Ctx.new_param(Ctx.get_type(GCC_JIT_TYPE_CONST_CHAR_PTR),
+                             "format")};
+    auto printf = Ctx.new_function(GCC_JIT_FUNCTION_IMPORTED, i, "printf",
+                                   format, 1);
+    auto main = Ctx.new_function(GCC_JIT_FUNCTION_EXPORTED, i, "main", none, 0);
+    auto b = main.new_block();
+    b.add_eval(Ctx.new_call(InitFn));
+    auto v = Ctx.new_call(MainFn);
+    switch (result) {
+    case TermKind::NumType:
+      b.add_eval(Ctx.new_call(printf, Ctx.new_rvalue("%lld\n"), v));
+      break;
+    case TermKind::BoolType: {
+      auto yes = main.new_block(), no = main.new_block();
+      b.end_with_conditional(
+          Ctx.new_comparison(GCC_JIT_COMPARISON_NE, v,
+                             Ctx.zero(Ctx.get_type(GCC_JIT_TYPE_LONG_LONG))),
+          yes, no);
+      yes.add_eval(Ctx.new_call(printf, Ctx.new_rvalue("true\n")));
+      yes.end_with_return(Ctx.zero(i));
+      no.add_eval(Ctx.new_call(printf, Ctx.new_rvalue("false\n")));
+      no.end_with_return(Ctx.zero(i));
+      return;
+    }
+    default:
+      b.add_eval(v);
+      break;
+    }
+    b.end_with_return(Ctx.zero(i));
+  }
+
+  // Writes a file, renamed into place so that concurrent runs never load a
+  // partial one.
+  bool CompileTo(const std::string &path,
+                 enum gcc_jit_output_kind kind =
+                     GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY) {
+    auto tmp = path + '.' + std::to_string(getpid());
+    Ctx.compile_to_file(kind, tmp.c_str());
+    if (auto err = gcc_jit_context_get_first_error(Ctx.get_inner_context())) {
+      fail(err);
+      unlink(tmp.c_str());
+      return false;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+      fail(strerror(errno));
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool Compile() {
+    Result = Ctx.compile();
+    if (!Result) {
+      auto err = gcc_jit_context_get_first_error(Ctx.get_inner_context());
+      fail(err ? err : "compilation failed");
+      return false;
+    }
+    Ctx.release();
+    Exports.push_back({"jian_init", nullptr, 0});
+    Exports.push_back({"jian_main", nullptr, 0});
+    for (auto &e : Exports) {
+      CodeMap::Get().Add(gcc_jit_result_get_code(Result, e.Symbol.c_str()),
+                         e.Symbol, e.Fn, e.Line);
+    }
+    return true;
+  }
+
+  long long Run() {
+    return start(gcc_jit_result_get_code(Result, "jian_init"),
+                 gcc_jit_result_get_code(Result, "jian_main"));
+  }
+};
+
+// Shared objects of compiled programs under the user's cache directory, named
+// by a hash of everything the generated code depends on.
+class Cache {
+  std::string Dir;
+  uint64_t Key{14695981039346656037ull};
+
+  explicit Cache(std::string dir) : Dir{std::move(dir)} {}
+
+public:
+  // Empty without a usable cache directory.
+  static std::optional<Cache> Open() {
+    std::string dir{};
+    if (auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+      dir = xdg;
+    } else if (auto home = getenv("HOME"); home && *home) {
+      dir = std::string{home} + "/.cache";
+      mkdir(dir.c_str(), 0755);
+    } else {
+      return std::nullopt;
+    }
+    dir += "/jian";
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return std::nullopt;
+    }
+    return Cache{std::move(dir)};
+  }
+
+  // Hashes the size first, so that adjacent inputs cannot be confused.
+  void Add(std::string_view data) {
+    auto step = [this](uint8_t c) { Key = (Key ^ c) * 1099511628211ull; };
+    for (size_t n = data.size(), i = 0; i < sizeof(n); i++) {
+      step(static_cast<uint8_t>(n >> (i * 8)));
+    }
+    for (auto c : data) {
+      step(static_cast<uint8_t>(c));
+    }
+  }
+
+  std::string Path() const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx",
+             static_cast<unsigned long long>(Key));
+    return Dir + '/' + name + ".so";
+  }
+};
+
+// A program compiled into the cache, loaded with the dynamic linker.
+class Library {
+  void *Handle;
+  void *Init, *Main;
+
+  Library(void *handle, void *init, void *main)
+      : Handle{handle}, Init{init}, Main{main} {}
+
+public:
+  static std::unique_ptr<Library> Open(const std::string &path) {
+    auto handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+      return nullptr;
+    }
+    auto init = dlsym(handle, "jian_init"), main = dlsym(handle, "jian_main");
+    if (!init || !main) {
+      dlclose(handle);
+      return nullptr;
+    }
+    return std::unique_ptr<Library>{new Library{handle, init, main}};
+  }
+
+  Library(const Library &) = delete;
+  Library &operator=(const Library &) = delete;
+
+  ~Library() { dlclose(Handle); }
+
+  long long Run() const { return start(Init, Main); }
+};
+
+} // namespace codegen
+
+namespace gc {
+
+// Runtime values are 64 bits wide. A reference is the address of an Object.
+using Value = int64_t;
+
+// Which fields of an object hold references, by index. Shared by every object
+// of one shape, it must outlive them.
+struct Layout {
+  Slice<const uint32_t> Pointers;
+};
+
+// Header in front of an object's fields.
+struct Object {
+  // Only large objects are marked in their header; cells of a block have their
+  // marks beside it.
+  static constexpr uint32_t Forwarded = 1, Marked = 2, Free = 4, Permanent = 8,
+                            Large = 16;
+
+  // A moved nursery object keeps its new address here, a free cell the next
+  // free cell.
+  union {
+    const Layout *Shape;
+    Object *Forward;
+  };
+  uint32_t Size;
+  uint32_t Flags;
+
+  Value *Fields() { return reinterpret_cast<Value *>(this + 1); }
+  size_t Bytes() const { return sizeof(Object) + Size * sizeof(Value); }
+};
+
+static inline Object *ref(Value v) {
+  return reinterpret_cast<Object *>(static_cast<uintptr_t>(v));
+}
+
+static inline Value value(const Object *o) {
+  return static_cast<Value>(reinterpret_cast<uintptr_t>(o));
+}
+
+// Two generations. Objects are bumped into the nursery, and a minor collection
+// copies whatever is reachable into the old generation, which holds cells of a
+// few size classes in aligned blocks. Once the old generation has doubled
+// since the last major collection it is marked, with mark bits kept beside
+// each block. Tracing keeps its own work list, so deep structures never
+// recurse.
+//
+// Marking is the only pause of a major collection. Blocks are then swept by a
+// background thread, and on allocation when a size class runs out before the
+// thread got to its blocks; the sweeper also frees blocks left empty. Sweeping
+// only touches mark bits and dead cells, which the program can no longer
+// reach, so it needs no lock per object.
+//
+// Objects are immutable once their fields are set, so old objects only point
+// into the nursery if they were allocated old, too large for it, and those are
+// remembered until the next minor collection.
+class Heap {
+public:
+  // Visits the references of some part of the program, like the registers of
+  // interpreted frames.
+  using Scanner = std::function<void(Heap &)>;
+
+private:
+  static constexpr size_t BlockSize = 64 * 1024;
+  // Cells start after a pointer back to the block.
+  static constexpr size_t CellsAt = 16;
+  static constexpr std::array<uint32_t, 12> Classes{
+      {16, 24, 32, 48, 64, 96, 128, 192, 256, 512, 1024, 2048}};
+
+  enum class Sweep : uint8_t { Swept, Unswept, Sweeping, Dead };
+
+  struct Block {
+    char *Data;
+    size_t Class;
+    std::atomic<Sweep> State;
+    // What sweeping found, for the allocator to take.
+    Object *Free;
+    std::array<uint64_t, (BlockSize / 16 + 63) / 64> Marks;
+
+    size_t Cells() const { return (BlockSize - CellsAt) / Classes[Class]; }
+
+    Object *Cell(size_t i) const {
+      return reinterpret_cast<Object *>(Data + CellsAt + i * Classes[Class]);
+    }
+
+    size_t IndexOf(const Object *o) const {
+      auto at = static_cast<size_t>(reinterpret_cast<const char *>(o) - Data);
+      return (at - CellsAt) / Classes[Class];
+    }
+
+    bool Marked(size_t i) const { return Marks[i / 64] >> (i % 64) & 1; }
+
+    // False if it was marked already.
+    bool Mark(size_t i) {
+      auto bit = uint64_t{1} << (i % 64);
+      auto was = Marks[i / 64] & bit;
+      Marks[i / 64] |= bit;
+      return !was;
+    }
+  };
+
+  std::unique_ptr<char[]> Nursery;
+  char *Bump, *Limit;
+  std::vector<std::unique_ptr<Block>> Blocks{};
+  std::array<Object *, Classes.size()> FreeCells{};
+  // Blocks of each class swept or still to sweep since the last major
+  // collection, and the next one to take cells from.
+  std::array<std::vector<Block *>, Classes.size()> Pending{};
+  std::array<size_t, Classes.size()> Next{};
+  std::vector<Object *> Large{};
+  std::vector<Object *> Work{}, Remembered{};
+  std::vector<Value *> Roots{};
+  std::vector<Scanner> Scanners{};
+  size_t Old{}, Threshold;
+  bool Marking{};
+
+  std::thread Sweeper{};
+  std::mutex Mutex{};
+  std::condition_variable Wake{}, Idle{};
+  std::vector<Block *> Queue{};
+  std::vector<Object *> Dying{};
+  bool Busy{}, Stopping{};
+
+  bool young(const Object *o) const {
+    auto p = reinterpret_cast<uintptr_t>(o);
+    return p >= reinterpret_cast<uintptr_t>(Nursery.get()) &&
+           p < reinterpret_cast<uintptr_t>(Limit);
+  }
+
+  static Block &blockOf(const Object *o) {
+    auto base = reinterpret_cast<uintptr_t>(o) & ~uintptr_t{BlockSize - 1};
+    return **reinterpret_cast<Block **>(base);
+  }
+
+  static size_t sizeClass(size_t bytes) {
+    size_t c = 0;
+    while (c < Classes.size() && Classes[c] < bytes) {
+      c++;
+    }
+    return c;
+  }
+
+  // Runs on either thread, whichever claimed the block.
+  static void sweep(Block &b) {
+    Object *free = nullptr;
+    auto live = false;
+    for (auto i = b.Cells(); i-- > 0;) {
+      if (b.Marked(i)) {
+        live = true;
+        continue;
+      }
+      auto cell = b.Cell(i);
+      cell->Flags = Object::Free;
+      cell->Forward = free;
+      free = cell;
+    }
+    b.Marks.fill(0);
+    if (!live) {
+      std::free(b.Data);
+      b.Data = nullptr;
+      b.Free = nullptr;
+      b.State.store(Sweep::Dead, std::memory_order_release);
+      return;
+    }
+    b.Free = free;
+    b.State.store(Sweep::Swept, std::memory_order_release);
+  }
+
+  static bool claim(Block &b) {
+    auto expected = Sweep::Unswept;
+    return b.State.compare_exchange_strong(expected, Sweep::Sweeping,
+                                           std::memory_order_acq_rel);
+  }
+
+  void sweeper() {
+    for (;;) {
+      std::vector<Block *> blocks{};
+      std::vector<Object *> dying{};
+      {
+        std::unique_lock<std::mutex> lock{Mutex};
+        Wake.wait(lock, [this] {
+          return Stopping || !Queue.empty() || !Dying.empty();
+        });
+        if (Stopping) {
+          return;
+        }
+        blocks.swap(Queue);
+        dying.swap(Dying);
+        Busy = true;
+      }
+      for (auto o : dying) {
+        free(o);
+      }
+      for (auto b : blocks) {
+        if (claim(*b)) {
+          sweep(*b);
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock{Mutex};
+        Busy = false;
+      }
+      Idle.notify_all();
+    }
+  }
+
+  // Sweeps whatever the background thread has not, waits for it and forgets
+  // the blocks it freed.
+  void finish() {
+    for (auto &b : Blocks) {
+      if (claim(*b)) {
+        sweep(*b);
+      }
+    }
+    {
+      std::unique_lock<std::mutex> lock{Mutex};
+      Idle.wait(lock, [this] { return !Busy && Queue.empty(); });
+    }
+    Blocks.erase(std::remove_if(Blocks.begin(), Blocks.end(),
+                                [](const std::unique_ptr<Block> &b) {
+                                  return b->State.load(
+                                             std::memory_order_acquire) ==
+                                         Sweep::Dead;
+                                }),
+                 Blocks.end());
+  }
+
+  void refill(size_t c) {
+    auto data = static_cast<char *>(aligned_alloc(BlockSize, BlockSize));
+    if (!data) {
+      panic("out of memory");
+    }
+    Blocks.push_back(std::unique_ptr<Block>{new Block{data, c, {}, {}, {}}});
+    auto &b = *Blocks.back();
+    *reinterpret_cast<Block **>(data) = &b;
+    for (auto i = b.Cells(); i-- > 0;) {
+      auto cell = b.Cell(i);
+      cell->Flags = Object::Free;
+      cell->Forward = FreeCells[c];
+      FreeCells[c] = cell;
+    }
+  }
+
+  // Takes the cells of the next swept block of class c, sweeping it here if
+  // the background thread has not yet.
+  void take(size_t c) {
+    while (Next[c] < Pending[c].size()) {
+      auto &b = *Pending[c][Next[c]++];
+      if (claim(b)) {
+        sweep(b);
+      }
+      while (b.State.load(std::memory_order_acquire) == Sweep::Sweeping) {
+        std::this_thread::yield();
+      }
+      if (b.State.load(std::memory_order_acquire) == Sweep::Swept && b.Free) {
+        FreeCells[c] = b.Free;
+        b.Free = nullptr;
+        return;
+      }
+    }
+    refill(c);
+  }
+
+  Object *allocateOld(size_t bytes) {
+    auto c = sizeClass(bytes);
+    Object *o;
+    if (c == Classes.size()) {
+      o = static_cast<Object *>(malloc(bytes));
+      if (!o) {
+        panic("out of memory");
+      }
+      o->Flags = Object::Large;
+      Large.push_back(o);
+    } else {
+      if (!FreeCells[c]) {
+        take(c);
+      }
+      o = FreeCells[c];
+      FreeCells[c] = o->Forward;
+      o->Flags = 0;
+      bytes = Classes[c];
+    }
+    Old += bytes;
+    return o;
+  }
+
+  void trace(Object *o) {
+    auto fields = o->Fields();
+    for (auto i : o->Shape->Pointers) {
+      Visit(fields[i]);
+    }
+  }
+
+  void scan() {
+    for (auto slot : Roots) {
+      Visit(*slot);
+    }
+    for (auto &s : Scanners) {
+      s(*this);
+    }
+  }
+
+  void drain() {
+    while (!Work.empty()) {
+      auto o = Work.back();
+      Work.pop_back();
+      trace(o);
+    }
+  }
+
+  void minor() {
+    scan();
+    for (auto o : Remembered) {
+      trace(o);
+    }
+    Remembered.clear();
+    drain();
+    Bump = Nursery.get();
+    Minors++;
+    if (Old > Threshold) {
+      major();
+    }
+  }
+
+  // Runs right after a minor collection, so everything live is old. Old is
+  // recounted while marking.
+  void major() {
+    finish();
+    Old = 0;
+    Marking = true;
+    scan();
+    drain();
+    Marking = false;
+
+    std::vector<Object *> dying{};
+    size_t kept = 0;
+    for (auto o : Large) {
+      if (o->Flags & Object::Marked) {
+        o->Flags &= ~Object::Marked;
+        Large[kept++] = o;
+      } else {
+        dying.push_back(o);
+      }
+    }
+    Large.resize(kept);
+    FreeCells.fill(nullptr);
+    Next.fill(0);
+    for (auto &p : Pending) {
+      p.clear();
+    }
+    std::vector<Block *> blocks{};
+    for (auto &b : Blocks) {
+      b->State.store(Sweep::Unswept, std::memory_order_relaxed);
+      Pending[b->Class].push_back(b.get());
+      blocks.push_back(b.get());
+    }
+    {
+      std::lock_guard<std::mutex> lock{Mutex};
+      Queue = std::move(blocks);
+      Dying = std::move(dying);
+    }
+    if (!Sweeper.joinable()) {
+      Sweeper = Spawn([this] { sweeper(); });
+    }
+    Wake.notify_one();
+    Threshold = std::max(Threshold, 2 * Old);
+    Majors++;
+  }
+
+public:
+  size_t Minors{}, Majors{};
+
+  explicit Heap(size_t nursery = size_t{1} << 20)
+      : Nursery{new char[nursery]}, Bump{Nursery.get()},
+        Limit{Nursery.get() + nursery}, Threshold{4 * nursery} {}
+
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  ~Heap() {
+    {
+      std::lock_guard<std::mutex> lock{Mutex};
+      Stopping = true;
+    }
+    Wake.notify_one();
+    if (Sweeper.joinable()) {
+      Sweeper.join();
+    }
+    for (auto &b : Blocks) {
+      free(b->Data);
+    }
+    for (auto o : Large) {
+      free(o);
+    }
+    for (auto o : Dying) {
+      free(o);
+    }
+  }
+
+  // Fields start out zero, which no scanner follows. They must be set before
+  // the next allocation, which may collect.
+  Object *Allocate(const Layout &shape, uint32_t size) {
+    auto bytes = sizeof(Object) + size_t{size} * sizeof(Value);
+    auto nursery = static_cast<size_t>(Limit - Nursery.get());
+    Object *o;
+    if (bytes > nursery / 8) {
+      o = allocateOld(bytes);
+      Remembered.push_back(o);
+    } else {
+      if (bytes > static_cast<size_t>(Limit - Bump)) {
+        minor();
+      }
+      o = reinterpret_cast<Object *>(Bump);
+      o->Flags = 0;
+      Bump += bytes;
+    }
+    o->Shape = &shape;
+    o->Size = size;
+    std::fill_n(o->Fields(), size, 0);
+    return o;
+  }
+
+  // Called by scanners for every slot that holds a reference.
+  void Visit(Value &slot) {
+    auto o = ref(slot);
+    if (!o || o->Flags & Object::Permanent) {
+      return;
+    }
+    if (Marking) {
+      if (o->Flags & Object::Large) {
+        if (!(o->Flags & Object::Marked)) {
+          o->Flags |= Object::Marked;
+          Old += o->Bytes();
+          Work.push_back(o);
+        }
+        return;
+      }
+      auto &b = blockOf(o);
+      if (b.Mark(b.IndexOf(o))) {
+        Old += Classes[b.Class];
+        Work.push_back(o);
+      }
+      return;
+    }
+    if (!young(o)) {
+      return;
+    }
+    if (!(o->Flags & Object::Forwarded)) {
+      auto copy = allocateOld(o->Bytes());
+      copy->Shape = o->Shape;
+      copy->Size = o->Size;
+      std::copy(o->Fields(), o->Fields() + o->Size, copy->Fields());
+      o->Forward = copy;
+      o->Flags = Object::Forwarded;
+      Work.push_back(copy);
+    }
+    slot = value(o->Forward);
+  }
+
+  void AddRoot(Value *slot) { Roots.push_back(slot); }
+
+  void RemoveRoot(Value *slot) {
+    auto it = std::find(Roots.begin(), Roots.end(), slot);
+    if (it != Roots.end()) {
+      Roots.erase(it);
+    }
+  }
+
+  void AddScanner(Scanner s) { Scanners.push_back(std::move(s)); }
+
+  void Collect() {
+    auto majors = Majors;
+    minor();
+    if (Majors == majors) {
+      major();
+    }
+  }
+};
+
+} // namespace gc
+
+namespace vm {
+
+using elab::Term;
+using elab::TermKind;
+
+// Numbers are themselves, booleans 0 or 1 and unit 0. Functions are closures:
+// references to a heap object holding the function and what it captured.
+// Nothing but closures is ever allocated, and since which values are references
+// is known from their types, immediates need no tag and numbers keep all 64
+// bits.
+using gc::Value;
+
+// Register based and fixed width: an opcode and three 16-bit operands. Values
+// that do not fit, such as numbers, globals and functions, are operands in the
+// function's constant pool k.
+enum class Op : uint16_t {
+  Const,     // r[A] = k[B]
+  Move,      // r[A] = r[B]
+  Global,    // r[A] = globals[k[B]]
+  SetGlobal, // globals[k[B]] = r[A]
+  Closure,   // r[A] = functions[k[B]] closed over r[C...]
+  Jump,      // pc = B | C << 16
+  JumpIfNot, // if !r[A]: pc = B | C << 16
+  Call,      // r[A] = functions[k[C]](r[B]...)
+  CallValue, // r[A] = r[C](r[B]...)
+  Return,    // return r[A]
+
+  // Superinstructions for the tail of a function, where most calls are.
+  ReturnConst,     // return k[B]
+  CallReturn,      // return functions[k[C]](r[B]...)
+  CallValueReturn, // return r[C](r[B]...)
+  SelfTail,        // r[0...] = r[B...], pc = 0
+};
+
+struct Instr {
+  Op Op;
+  uint16_t A, B, C;
+};
+
+class Machine;
+struct Function;
+
+// Calling convention shared by the interpreter and native code, so that a
+// dispatch entry can be swapped while callers keep running. The closure's
+// first field is the function.
+using Entry = Value (*)(gc::Object *closure, const Value *args);
+
+// Registers that hold references while the instruction at Pc runs. Frames are
+// only ever collected from at one of these: calls and allocations.
+struct Safepoint {
+  uint32_t Pc, First, Count;
+};
+
+// What a function that captures nothing is as a value, shared by all uses.
+struct Closure {
+  gc::Object Header;
+  Value Fn;
+};
+
+// A definition or lambda. Dispatch is the first member, native code loads it
+// without knowing the rest of the layout.
+struct Function {
+  std::atomic<Entry> Dispatch;
+  Machine *VM;
+  std::string Name;
+  uint32_t Index, Arity, Regs;
+  const elab::Fn *Body;
+  // Captured values follow the parameters in the frame. Shape describes the
+  // closure: the function, then the captures.
+  uint32_t Captures{};
+  gc::Layout Shape{};
+  Closure Static{};
+  // Native code for the function with its arguments in registers, once
+  // compiled.
+  std::atomic<void *> Direct{};
+  // What the interpreter runs: Code, Constants and the maps once assembled,
+  // or a mapped artifact.
+  const Instr *Text{};
+  uint32_t Length{};
+  const Value *Pool{};
+  Slice<const Safepoint> Safepoints{};
+  Slice<const uint16_t> Live{};
+  std::vector<Instr> Code{};
+  std::vector<Value> Constants{};
+  std::vector<Safepoint> Maps{};
+  std::vector<uint16_t> LiveRegs{};
+  std::vector<uint32_t> References{};
+  uint32_t Calls{};
+  // Source lines for the profiler, if recorded: where the function is
+  // written, and where each instruction of Code comes from.
+  uint32_t Line{};
+  std::vector<uint32_t> Lines{};
+
+  void Finish() {
+    Text = Code.data();
+    Length = static_cast<uint32_t>(Code.size());
+    Pool = Constants.data();
+    Safepoints = {Maps.data(), Maps.size()};
+    Live = {LiveRegs.data(), LiveRegs.size()};
+    Shape.Pointers = {References.data(), References.size()};
+  }
+
+  // Where the collector finds the references of a frame stopped at pc.
+  const Safepoint &At(const Instr *pc) const {
+    auto at = static_cast<uint32_t>(pc - Text);
+    auto it = std::lower_bound(
+        Safepoints.begin(), Safepoints.end(), at,
+        [](const Safepoint &s, uint32_t i) { return s.Pc < i; });
+    if (it == Safepoints.end() || it->Pc != at) {
+      panic("no stack map at safepoint");
+    }
+    return *it;
+  }
+};
+
+static inline Function *function(gc::Object *closure) {
+  return reinterpret_cast<Function *>(
+      static_cast<uintptr_t>(closure->Fields()[0]));
+}
+
+// An interpreted activation. Frames are linked from the machine so that the
+// collector finds every register, Pc is stored before each safepoint.
+struct Frame {
+  Frame *Caller;
+  Function *Fn;
+  Value *Regs;
+  const Instr *Pc;
+};
+
+// Everything code refers to at run time. Both tables are sized before the
+// program starts, so native code may embed their addresses.
+struct Image {
+  std::vector<std::unique_ptr<Function>> Functions{};
+  std::vector<Function *> Table{};
+  std::vector<Value> Globals{};
+  // Globals that hold references.
+  std::vector<uint32_t> References{};
+  std::unordered_map<int, uint32_t> FnOf{}, GlobalOf{};
+};
+
+// What native code calls back into, since the machine is defined after it.
+struct Runtime {
+  Frame **Frames;
+  Value (*Closure)(Function *callee, const Value *captures);
+  Value (*Call)(Value closure, const Value *args);
+};
+
+// Compiles one function from its bytecode to the interpreter's calling
+// convention. Calls go through dispatch entries, so code compiled at different
+// times links up without relocations. The body takes its arguments in
+// registers, and so do self calls and calls to functions that were already
+// native; only the entry reads them from the interpreter's array.
+//
+// Registers that a stack map mentions live in a frame linked like an
+// interpreted one, with Pc stored before each safepoint, so the collector reads
+// native frames through the same maps. All other registers are locals, and a
+// function that never holds a reference has no frame at all.
+class Native {
+  gccjit::context Ctx;
+  const Image &Image;
+  const Runtime &Runtime;
+  Function &Fn;
+  gccjit::type LL, Int, VoidPtr, Args, EntryType, FrameType;
+  gccjit::field CallerField{}, FnField{}, RegsField{}, PcField{};
+  gccjit::function F{};
+  gccjit::param Self{};
+  std::vector<gccjit::lvalue> Locals{};
+  std::vector<bool> Framed{};
+  gccjit::lvalue Slots{}, Shadow{};
+  bool Rooted{};
+  int Temps{};
+
+  gccjit::rvalue constant(Value v) {
+    return Ctx.new_rvalue(LL, static_cast<long>(v));
+  }
+
+  gccjit::rvalue pointer(gccjit::type t, const void *p) {
+    return Ctx.new_rvalue(t, const_cast<void *>(p));
+  }
+
+  gccjit::rvalue index(uint32_t i) {
+    return Ctx.new_rvalue(Int, static_cast<int>(i));
+  }
+
+  gccjit::lvalue reg(uint32_t r) {
+    return Framed[r] ? Ctx.new_array_access(Slots, index(r)) : Locals[r];
+  }
+
+  gccjit::lvalue frames() {
+    return pointer(VoidPtr.get_pointer(), Runtime.Frames).dereference();
+  }
+
+  gccjit::type signature(gccjit::type ret,
+                         const std::vector<gccjit::type> &params) {
+    std::vector<gcc_jit_type *> raw{};
+    for (auto &p : params) {
+      raw.push_back(p.get_inner_type());
+    }
+    return gccjit::type{gcc_jit_context_new_function_ptr_type(
+        Ctx.get_inner_context(), nullptr, ret.get_inner_type(),
+        static_cast<int>(raw.size()), raw.data(), 0)};
+  }
+
+  // Type of a body: the closure, then n arguments.
+  gccjit::type direct(size_t n) {
+    std::vector<gccjit::type> params(n + 1, LL);
+    params[0] = VoidPtr;
+    return signature(LL, params);
+  }
+
+  // Arguments to interpreted code are an array. Registers in the frame
+  // already are one.
+  gccjit::rvalue pack(gccjit::block &b, uint32_t base, uint32_t n) {
+    if (n == 0) {
+      return Ctx.new_null(Args);
+    }
+    if (std::all_of(Framed.begin() + base, Framed.begin() + base + n,
+                    [](bool f) { return f; })) {
+      return Ctx.new_cast(reg(base).get_address(), Args);
+    }
+    auto a = F.new_local(Ctx.new_array_type(LL, static_cast<int>(n)),
+                         'a' + std::to_string(Temps++));
+    for (uint32_t i = 0; i < n; i++) {
+      b.add_assignment(Ctx.new_array_access(a, index(i)), reg(base + i));
+    }
+    return Ctx.new_cast(Ctx.new_array_access(a, index(0)).get_address(), Args);
+  }
+
+  gccjit::rvalue call(gccjit::rvalue code,
+                      const std::vector<gccjit::rvalue> &args) {
+    std::vector<gcc_jit_rvalue *> raw{};
+    for (auto &a : args) {
+      raw.push_back(a.get_inner_rvalue());
+    }
+    return gccjit::rvalue{gcc_jit_context_new_call_through_ptr(
+        Ctx.get_inner_context(), nullptr, code.get_inner_rvalue(),
+        static_cast<int>(raw.size()), raw.data())};
+  }
+
+  gccjit::rvalue invoke(gccjit::block &b, Function *callee, uint32_t base) {
+    auto self = pointer(VoidPtr, &callee->Static.Header);
+    auto code = callee->Direct.load(std::memory_order_acquire);
+    if (callee == &Fn || code) {
+      std::vector<gccjit::rvalue> args{self};
+      for (uint32_t i = 0; i < callee->Arity; i++) {
+        args.push_back(reg(base + i));
+      }
+      return callee == &Fn ? Ctx.new_call(F, args)
+                           : call(pointer(direct(callee->Arity), code), args);
+    }
+    auto entry = pointer(EntryType.get_pointer(), &callee->Dispatch);
+    return call(entry.dereference(), {self, pack(b, base, callee->Arity)});
+  }
+
+  // The arity is only known at run time, so the arguments are the frame from
+  // base on, as in the interpreter.
+  gccjit::rvalue invoke(const Instr &in) {
+    return call(pointer(signature(LL, {LL, Args}),
+                        reinterpret_cast<void *>(Runtime.Call)),
+                {reg(in.C), Ctx.new_cast(reg(in.B).get_address(), Args)});
+  }
+
+  void safepoint(gccjit::block &b, uint32_t at) {
+    if (Rooted) {
+      b.add_assignment(Shadow.access_field(PcField),
+                       pointer(VoidPtr, Fn.Text + at));
+    }
+  }
+
+  void leave(gccjit::block &b, gccjit::rvalue v) {
+    if (Rooted) {
+      auto t = F.new_local(LL, 't' + std::to_string(Temps++));
+      b.add_assignment(t, v);
+      b.add_assignment(frames(), Shadow.access_field(CallerField));
+      v = t;
+    }
+    b.end_with_return(v);
+  }
+
+  // Blocks start at jump targets and after anything that leaves one, so none
+  // is unreachable.
+  std::vector<bool> leaders() const {
+    std::vector<bool> leader(Fn.Length + 1);
+    leader[0] = true;
+    for (uint32_t i = 0; i < Fn.Length; i++) {
+      auto &in = Fn.Text[i];
+      switch (in.Op) {
+      case Op::Jump:
+      case Op::JumpIfNot:
+        leader[uint32_t{in.B} | uint32_t{in.C} << 16] = true;
+        leader[i + 1] = true;
+        break;
+      case Op::Return:
+      case Op::ReturnConst:
+      case Op::CallReturn:
+      case Op::CallValueReturn:
+      case Op::SelfTail:
+        leader[i + 1] = true;
+        break;
+      default:
+        break;
+      }
+    }
+    return leader;
+  }
+
+  void body(gccjit::block b) {
+    auto leader = leaders();
+    std::vector<gccjit::block> blocks(Fn.Length);
+    for (uint32_t i = 0; i < Fn.Length; i++) {
+      if (leader[i]) {
+        blocks[i] = F.new_block();
+      }
+    }
+    auto k = Fn.Pool;
+    auto global = [this, k](const Instr &in) {
+      auto slot = &Image.Globals[static_cast<size_t>(k[in.B])];
+      return pointer(LL.get_pointer(), slot).dereference();
+    };
+    auto target = [&blocks](const Instr &in) {
+      return blocks[uint32_t{in.B} | uint32_t{in.C} << 16];
+    };
+    auto open = true;
+    for (uint32_t i = 0; i < Fn.Length; i++) {
+      if (leader[i]) {
+        if (open) {
+          b.end_with_jump(blocks[i]);
+        }
+        b = blocks[i];
+      }
+      open = true;
+      auto &in = Fn.Text[i];
+      switch (in.Op) {
+      case Op::Const:
+        b.add_assignment(reg(in.A), constant(k[in.B]));
+        break;
+      case Op::Move:
+        b.add_assignment(reg(in.A), reg(in.B));
+        break;
+      case Op::Global:
+        b.add_assignment(reg(in.A), global(in));
+        break;
+      case Op::SetGlobal:
+        b.add_assignment(global(in), reg(in.A));
+        break;
+      case Op::Closure: {
+        auto callee = Image.Table[static_cast<size_t>(k[in.B])];
+        if (!callee->Captures) {
+          b.add_assignment(reg(in.A),
+                           constant(gc::value(&callee->Static.Header)));
+          break;
+        }
+        safepoint(b, i);
+        auto closure = pointer(signature(LL, {VoidPtr, Args}),
+                               reinterpret_cast<void *>(Runtime.Closure));
+        b.add_assignment(
+            reg(in.A),
+            call(closure, {pointer(VoidPtr, callee),
+                           Ctx.new_cast(reg(in.C).get_address(), Args)}));
+        break;
+      }
+      case Op::Jump:
+        b.end_with_jump(target(in));
+        open = false;
+        break;
+      case Op::JumpIfNot:
+        b.end_with_conditional(
+            Ctx.new_comparison(GCC_JIT_COMPARISON_NE, reg(in.A), constant(0)),
+            blocks[i + 1], target(in));
+        open = false;
+        break;
+      case Op::Call:
+        safepoint(b, i);
+        b.add_assignment(
+            reg(in.A),
+            invoke(b, Image.Table[static_cast<size_t>(k[in.C])], in.B));
+        break;
+      case Op::CallValue:
+        safepoint(b, i);
+        b.add_assignment(reg(in.A), invoke(in));
+        break;
+      case Op::Return:
+        leave(b, reg(in.A));
+        open = false;
+        break;
+      case Op::ReturnConst:
+        leave(b, constant(k[in.B]));
+        open = false;
+        break;
+      case Op::CallReturn:
+        safepoint(b, i);
+        leave(b, invoke(b, Image.Table[static_cast<size_t>(k[in.C])], in.B));
+        open = false;
+        break;
+      case Op::CallValueReturn:
+        safepoint(b, i);
+        leave(b, invoke(in));
+        open = false;
+        break;
+      case Op::SelfTail: {
+        std::vector<gccjit::lvalue> temps{};
+        for (uint32_t j = 0; j < Fn.Arity; j++) {
+          temps.push_back(F.new_local(LL, 't' + std::to_string(Temps++)));
+          b.add_assignment(temps[j], reg(in.B + j));
+        }
+        for (uint32_t j = 0; j < Fn.Arity; j++) {
+          b.add_assignment(reg(j), temps[j]);
+        }
+        b.end_with_jump(blocks[0]);
+        open = false;
+        break;
+      }
+      }
+    }
+  }
+
+  // Registers the collector reads: those in a stack map, captures being
+  // copied into a closure and the arguments of calls through values.
+  void frame() {
+    Framed.assign(Fn.Regs + 1, false);
+    for (auto &s : Fn.Safepoints) {
+      for (uint32_t i = 0; i < s.Count; i++) {
+        Framed[Fn.Live[s.First + i]] = true;
+      }
+    }
+    for (uint32_t i = 0; i < Fn.Length; i++) {
+      auto &in = Fn.Text[i];
+      if (in.Op == Op::Closure) {
+        auto n = Image.Table[static_cast<size_t>(Fn.Pool[in.B])]->Captures;
+        std::fill_n(Framed.begin() + in.C, n, true);
+      } else if (in.Op == Op::CallValue || in.Op == Op::CallValueReturn) {
+        std::fill(Framed.begin() + in.B, Framed.end(), true);
+      }
+    }
+    Rooted = std::find(Framed.begin(), Framed.end(), true) != Framed.end();
+  }
+
+public:
+  gcc_jit_result *Result{};
+  void *Direct{};
+
+  Native(const struct Image &image, const struct Runtime &runtime,
+         Function &fn)
+      : Ctx{gccjit::context::acquire()}, Image{image}, Runtime{runtime},
+        Fn{fn}, LL{Ctx.get_type(GCC_JIT_TYPE_LONG_LONG)},
+        Int{Ctx.get_type(GCC_JIT_TYPE_INT)},
+        VoidPtr{Ctx.get_type(GCC_JIT_TYPE_VOID_PTR)},
+        Args{LL.get_const().get_pointer()} {
+    EntryType = signature(LL, {VoidPtr, Args});
+    CallerField = Ctx.new_field(VoidPtr, "caller");
+    FnField = Ctx.new_field(VoidPtr, "fn");
+    RegsField = Ctx.new_field(LL.get_pointer(), "regs");
+    PcField = Ctx.new_field(VoidPtr, "pc");
+    std::vector<gccjit::field> fields{CallerField, FnField, RegsField, PcField};
+    FrameType = Ctx.new_struct_type("frame", fields);
+    Ctx.set_int_option(GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL, 2);
+  }
+
+  Native(const Native &) = delete;
+  Native &operator=(const Native &) = delete;
+
+  ~Native() { Ctx.release(); }
+
+  // Null if compilation failed, the function then stays interpreted.
+  Entry Compile() {
+    frame();
+    auto name = "jian_" + Fn.Name + '_' + std::to_string(Fn.Index);
+    Self = Ctx.new_param(VoidPtr, "closure");
+    std::vector<gccjit::param> params{Self};
+    for (uint32_t i = 0; i < Fn.Arity; i++) {
+      params.push_back(Ctx.new_param(LL, 'x' + std::to_string(i)));
+    }
+    F = Ctx.new_function(GCC_JIT_FUNCTION_EXPORTED, LL, name, params, 0);
+    for (uint32_t r = 0; r < Fn.Regs; r++) {
+      Locals.push_back(Framed[r] ? gccjit::lvalue{}
+                                 : F.new_local(LL, 'r' + std::to_string(r)));
+    }
+    auto b = F.new_block();
+    if (Rooted) {
+      Slots = F.new_local(
+          Ctx.new_array_type(LL, static_cast<int>(Fn.Regs + 1)), "regs");
+      Shadow = F.new_local(FrameType, "frame");
+      b.add_assignment(Shadow.access_field(CallerField), frames());
+      b.add_assignment(Shadow.access_field(FnField), pointer(VoidPtr, &Fn));
+      b.add_assignment(Shadow.access_field(RegsField),
+                       Ctx.new_array_access(Slots, index(0)).get_address());
+      b.add_assignment(Shadow.access_field(PcField), pointer(VoidPtr, Fn.Text));
+      b.add_assignment(frames(), Ctx.new_cast(Shadow.get_address(), VoidPtr));
+    }
+    for (uint32_t i = 0; i < Fn.Arity; i++) {
+      b.add_assignment(reg(i), params[1 + i]);
+    }
+    if (Fn.Captures) {
+      // After the header and the function.
+      auto fields = Ctx.new_cast(Self, Args);
+      for (uint32_t i = 0; i < Fn.Captures; i++) {
+        b.add_assignment(reg(Fn.Arity + i),
+                         Ctx.new_array_access(fields, index(3 + i)));
+      }
+    }
+    body(b);
+
+    auto argv = Ctx.new_param(Args, "args");
+    std::vector<gccjit::param> entryParams{Ctx.new_param(VoidPtr, "closure"),
+                                           argv};
+    auto entry = Ctx.new_function(GCC_JIT_FUNCTION_EXPORTED, LL,
+                                  name + "_entry", entryParams, 0);
+    std::vector<gccjit::rvalue> args{entryParams[0]};
+    for (uint32_t i = 0; i < Fn.Arity; i++) {
+      args.push_back(Ctx.new_array_access(argv, index(i)));
+    }
+    entry.new_block().end_with_return(Ctx.new_call(F, args));
+
+    Result = Ctx.compile();
+    if (!Result) {
+      return nullptr;
+    }
+    Direct = gcc_jit_result_get_code(Result, name.c_str());
+    auto code = gcc_jit_result_get_code(Result, (name + "_entry").c_str());
+    codegen::CodeMap::Get().Add(Direct, name, Fn.Body, Fn.Line);
+    codegen::CodeMap::Get().Add(code, name + "_entry", Fn.Body, Fn.Line);
+    return reinterpret_cast<Entry>(code);
+  }
+};
+
+// Interprets bytecode. Functions called Hot times are queued for a background
+// thread, which compiles them to native code and swaps their dispatch entry;
+// callers pick it up on their next call. Closures live on the heap, which
+// finds its roots in globals and interpreted frames.
+class Machine {
+  bool JIT;
+  std::unique_ptr<Value[]> Stack;
+  size_t StackSize, Top{};
+  std::mutex Mutex{};
+  std::condition_variable Ready{};
+  std::deque<Function *> Queue{};
+  bool Stopping{};
+  std::thread Worker{};
+  std::vector<gcc_jit_result *> Results{};
+
+  void promote(Function *fn) {
+    {
+      std::lock_guard<std::mutex> lock{Mutex};
+      Queue.push_back(fn);
+    }
+    if (!Worker.joinable()) {
+      Worker = Spawn([this] { work(); });
+    }
+    Ready.notify_one();
+  }
+
+  void work() {
+    for (;;) {
+      Function *fn;
+      {
+        std::unique_lock<std::mutex> lock{Mutex};
+        Ready.wait(lock, [this] { return Stopping || !Queue.empty(); });
+        if (Stopping) {
+          return;
+        }
+        fn = Queue.front();
+        Queue.pop_front();
+      }
+      Native native{Image, Hooks, *fn};
+      if (auto entry = native.Compile()) {
+        Results.push_back(native.Result);
+        fn->Direct.store(native.Direct, std::memory_order_release);
+        fn->Dispatch.store(entry, std::memory_order_release);
+      }
+    }
+  }
+
+  static Value closure(Function *callee, const Value *captures) {
+    if (!callee->Captures) {
+      return gc::value(&callee->Static.Header);
+    }
+    auto o = callee->VM->Heap.Allocate(callee->Shape, callee->Captures + 1);
+    o->Fields()[0] = callee->Static.Fn;
+    std::copy(captures, captures + callee->Captures, o->Fields() + 1);
+    return gc::value(o);
+  }
+
+  static Value callValue(Value closure, const Value *args) {
+    auto c = gc::ref(closure);
+    return function(c)->Dispatch.load(std::memory_order_acquire)(c, args);
+  }
+
+  // Interpreted and native frames alike.
+  void scan(gc::Heap &heap) {
+    for (auto i : Image.References) {
+      heap.Visit(Image.Globals[i]);
+    }
+    for (auto f = Frames; f; f = f->Caller) {
+      auto &s = f->Fn->At(f->Pc);
+      for (uint32_t i = 0; i < s.Count; i++) {
+        heap.Visit(f->Regs[f->Fn->Live[s.First + i]]);
+      }
+    }
+  }
+
+public:
+  static constexpr uint32_t Hot = 1000;
+
+  struct Image Image{};
+  gc::Heap Heap{};
+  Frame *Frames{};
+  const Runtime Hooks{&Frames, &closure, &callValue};
+
+  explicit Machine(bool jit, size_t stack = size_t{1} << 20)
+      : JIT{jit}, Stack{new Value[stack]}, StackSize{stack} {
+    Heap.AddScanner([this](gc::Heap &heap) { scan(heap); });
+  }
+
+  Machine(const Machine &) = delete;
+  Machine &operator=(const Machine &) = delete;
+
+  ~Machine() {
+    {
+      std::lock_guard<std::mutex> lock{Mutex};
+      Stopping = true;
+    }
+    Ready.notify_one();
+    if (Worker.joinable()) {
+      Worker.join();
+    }
+    for (auto r : Results) {
+      gcc_jit_result_release(r);
+    }
+  }
+
+  Function &NewFunction(std::string name, uint32_t arity,
+                        const elab::Fn *body) {
+    auto index = static_cast<uint32_t>(Image.Functions.size());
+    Image.Functions.push_back(std::unique_ptr<Function>{
+        new Function{{&Interpret}, this, std::move(name), index, arity, arity,
+                     body}});
+    auto &fn = *Image.Functions.back();
+    fn.Static.Header.Shape = &fn.Shape;
+    fn.Static.Header.Size = 1;
+    fn.Static.Header.Flags = gc::Object::Permanent;
+    fn.Static.Fn = static_cast<Value>(reinterpret_cast<uintptr_t>(&fn));
+    Image.Table.push_back(&fn);
+    return fn;
+  }
+
+  Value Run(Function &fn) { return Interpret(&fn.Static.Header, nullptr); }
+
+  // Self tail calls are loops, so they count as calls too.
+  void count(Function *fn) {
+    if (++fn->Calls == Hot && JIT && fn->Body) {
+      promote(fn);
+    }
+  }
+
+  static Value Interpret(gc::Object *self, const Value *args) {
+    auto fn = function(self);
+    auto &vm = *fn->VM;
+    vm.count(fn);
+    if (vm.Top + fn->Regs > vm.StackSize) {
+      panic("stack overflow");
+    }
+    auto r = vm.Stack.get() + vm.Top;
+    vm.Top += fn->Regs;
+    std::copy(args, args + fn->Arity, r);
+    std::copy(self->Fields() + 1, self->Fields() + 1 + fn->Captures,
+              r + fn->Arity);
+
+    auto code = fn->Text;
+    auto k = fn->Pool;
+    auto &table = vm.Image.Table;
+    auto &globals = vm.Image.Globals;
+    Frame frame{vm.Frames, fn, r, code};
+    vm.Frames = &frame;
+    auto call = [](gc::Object *callee, const Value *argv) {
+      return function(callee)->Dispatch.load(std::memory_order_acquire)(callee,
+                                                                       argv);
+    };
+    auto direct = [&table](Value index) {
+      return &table[static_cast<size_t>(index)]->Static.Header;
+    };
+    auto leave = [&vm, &frame, fn](Value v) {
+      vm.Frames = frame.Caller;
+      vm.Top -= fn->Regs;
+      return v;
+    };
+    auto target = [code](const Instr &i) {
+      return code + (uint32_t{i.B} | uint32_t{i.C} << 16);
+    };
+    auto pc = code;
+
+#ifdef JIAN_THREADED_DISPATCH
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#else
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+    // In the order of Op.
+    static void *const labels[] = {
+        &&Const,       &&Move,           &&Global,   &&SetGlobal, &&Closure,
+        &&Jump,        &&JumpIfNot,      &&Call,     &&CallValue, &&Return,
+        &&ReturnConst, &&CallReturn,     &&CallValueReturn, &&SelfTail};
+#define JIAN_OP(op) op:
+#define JIAN_NEXT() goto *labels[static_cast<uint16_t>(pc->Op)]
+    JIAN_NEXT();
+#else
+#define JIAN_OP(op) case Op::op:
+#define JIAN_NEXT() continue
+    for (;;) {
+      switch (pc->Op) {
+#endif
+      JIAN_OP(Const) {
+        r[pc->A] = k[pc->B];
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(Move) {
+        r[pc->A] = r[pc->B];
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(Global) {
+        r[pc->A] = globals[static_cast<size_t>(k[pc->B])];
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(SetGlobal) {
+        globals[static_cast<size_t>(k[pc->B])] = r[pc->A];
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(Closure) {
+        frame.Pc = pc;
+        r[pc->A] = closure(table[static_cast<size_t>(k[pc->B])], r + pc->C);
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(Jump) {
+        pc = target(*pc);
+        JIAN_NEXT();
+      }
+      JIAN_OP(JumpIfNot) {
+        pc = r[pc->A] ? pc + 1 : target(*pc);
+        JIAN_NEXT();
+      }
+      JIAN_OP(Call) {
+        frame.Pc = pc;
+        r[pc->A] = call(direct(k[pc->C]), r + pc->B);
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(CallValue) {
+        frame.Pc = pc;
+        r[pc->A] = callValue(r[pc->C], r + pc->B);
+        pc++;
+        JIAN_NEXT();
+      }
+      JIAN_OP(Return) { return leave(r[pc->A]); }
+      JIAN_OP(ReturnConst) { return leave(k[pc->B]); }
+      JIAN_OP(CallReturn) {
+        frame.Pc = pc;
+        return leave(call(direct(k[pc->C]), r + pc->B));
+      }
+      JIAN_OP(CallValueReturn) {
+        frame.Pc = pc;
+        return leave(callValue(r[pc->C], r + pc->B));
+      }
+      JIAN_OP(SelfTail) {
+        std::copy(r + pc->B, r + pc->B + fn->Arity, r);
+        vm.count(fn);
+        pc = code;
+        JIAN_NEXT();
+      }
+#ifdef JIAN_THREADED_DISPATCH
+#ifdef __clang__
+#pragma clang diagnostic pop
+#else
+#pragma GCC diagnostic pop
+#endif
+#else
+      }
+    }
+#endif
+#undef JIAN_OP
+#undef JIAN_NEXT
+  }
+};
+
+// Samples a running program on every millisecond of CPU time it uses, from
+// SIGPROF. A sample is the interrupted program counter, which tells compiled
+// code apart by address, and the function of the machine's innermost frame,
+// which names what is interpreted, with the instruction the frame last stored:
+// its latest call or allocation, or its entry. The handler only writes into
+// a buffer allocated up front. Threads of the runtime, such as the compiler,
+// the sweeper and the pool, are started by Spawn and never take the signal.
+class Sampler {
+public:
+  struct Sample {
+    uintptr_t Pc;
+    const Function *Fn;
+    const Instr *At;
+  };
+
+  static constexpr int Interval = 1000;
+
+private:
+  static constexpr size_t Capacity = size_t{1} << 20;
+  static inline std::atomic<Sampler *> Active{};
+
+  const Machine *VM;
+  std::unique_ptr<Sample[]> Buffer{new Sample[Capacity]};
+  std::atomic<size_t> Count{};
+  struct sigaction Previous {};
+  bool Running{};
+
+  static uintptr_t pc(void *context) {
+    auto uc = static_cast<ucontext_t *>(context);
+#if defined(__linux__) && defined(__x86_64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__linux__) && defined(__aarch64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext.pc);
+#elif defined(__APPLE__) && defined(__x86_64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext->__ss.__rip);
+#elif defined(__APPLE__) && defined(__aarch64__)
+    return static_cast<uintptr_t>(uc->uc_mcontext->__ss.__pc);
+#else
+    (void)uc;
+    return 0;
+#endif
+  }
+
+  static void take(int, siginfo_t *, void *context) {
+    auto s = Active.load(std::memory_order_relaxed);
+    if (!s) {
+      return;
+    }
+    auto n = s->Count.fetch_add(1, std::memory_order_relaxed);
+    if (n < Capacity) {
+      auto frame = s->VM ? s->VM->Frames : nullptr;
+      s->Buffer[n] = {pc(context), frame ? frame->Fn : nullptr,
+                      frame ? frame->Pc : nullptr};
+    }
+  }
+
+public:
+  // Starts sampling, with frames read from vm if there is one.
+  explicit Sampler(const Machine *vm) : VM{vm} {
+    Active.store(this);
+    struct sigaction sa {};
+    sa.sa_sigaction = take;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, &Previous);
+    itimerval t{{0, Interval}, {0, Interval}};
+    Running = setitimer(ITIMER_PROF, &t, nullptr) == 0;
+  }
+
+  Sampler(const Sampler &) = delete;
+  Sampler &operator=(const Sampler &) = delete;
+
+  ~Sampler() { Stop(); }
+
+  void Stop() {
+    if (Running) {
+      itimerval off{};
+      setitimer(ITIMER_PROF, &off, nullptr);
+      Running = false;
+    }
+    sigaction(SIGPROF, &Previous, nullptr);
+    Active.store(nullptr);
+  }
+
+  // What was taken before the buffer filled up. Only read once stopped.
+  Slice<const Sample> Samples() const {
+    return {Buffer.get(), std::min(Count.load(), Capacity)};
+  }
+
+  size_t Dropped() const { return Count.load() - Samples().Size; }
+};
+
+// Translates checked definitions to bytecode. Registers are allocated like a
+// stack: temporaries of a call are released once it is emitted. Expressions in
+// tail position end the function themselves, using the superinstructions.
+// Which registers hold references follows from the elaborated types, and is
+// recorded at every safepoint.
+class Assembler {
+  // A lambda waiting for its body, with the variables it closes over and the
+  // definition it is written in.
+  struct Lambda {
+    Function *Fn;
+    Term *Type;
+    std::vector<Term *> Captured;
+    const elab::Definition *Owner;
+  };
+
+  Machine &VM;
+  elab::Elab &Elab;
+  Function *Fn{};
+  // The definition the term being assembled is in, and its line.
+  const elab::Definition *Owner{};
+  uint32_t Line{};
+  const std::vector<Term *> *Captured{};
+  uint32_t Top{};
+  std::vector<bool> Holds{};
+  std::unordered_map<Value, uint16_t> Pool{};
+  std::deque<Lambda> Lambdas{};
+
+  uint16_t alloc(uint32_t n = 1) {
+    auto r = Top;
+    Top += n;
+    if (Top > UINT16_MAX) {
+      panic("too many registers");
+    }
+    Fn->Regs = std::max(Fn->Regs, Top);
+    if (Holds.size() < Top) {
+      Holds.resize(Top);
+    }
+    std::fill(Holds.begin() + r, Holds.begin() + Top, false);
+    return static_cast<uint16_t>(r);
+  }
+
+  bool reference(Term *ty) {
+    return Elab.Force(ty)->Kind == TermKind::FnType;
+  }
+
+  // Register r now holds a value of type ty.
+  void holds(uint32_t r, Term *ty) {
+    Holds[r] = reference(ty);
+  }
+
+  // Records the stack map of the instruction emitted next.
+  void safepoint() {
+    auto first = static_cast<uint32_t>(Fn->LiveRegs.size());
+    for (uint32_t r = 0; r < Top; r++) {
+      if (Holds[r]) {
+        Fn->LiveRegs.push_back(static_cast<uint16_t>(r));
+      }
+    }
+    Fn->Maps.push_back(
+        {static_cast<uint32_t>(Fn->Code.size()), first,
+         static_cast<uint32_t>(Fn->LiveRegs.size()) - first});
+  }
+
+  uint16_t constant(Value v) {
+    auto it = Pool.find(v);
+    if (it != Pool.end()) {
+      return it->second;
+    }
+    if (Fn->Constants.size() > UINT16_MAX) {
+      panic("too many constants");
+    }
+    auto k = static_cast<uint16_t>(Fn->Constants.size());
+    Fn->Constants.push_back(v);
+    Pool.emplace(v, k);
+    return k;
+  }
+
+  void emit(Op op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0) {
+    Fn->Code.push_back({op, a, b, c});
+    if (Locate) {
+      Fn->Lines.push_back(Line);
+    }
+  }
+
+  // The line of t, or of what it is part of if t has none.
+  uint32_t line(const Term *t) const {
+    auto l = Owner ? Owner->Line(t) : 0;
+    return l ? l : Line;
+  }
+
+  size_t jump(Op op, uint16_t a = 0) {
+    emit(op, a);
+    return Fn->Code.size() - 1;
+  }
+
+  void patch(size_t at) {
+    auto target = static_cast<uint32_t>(Fn->Code.size());
+    Fn->Code[at].B = static_cast<uint16_t>(target);
+    Fn->Code[at].C = static_cast<uint16_t>(target >> 16);
+  }
+
+  std::optional<Value> literal(Term *t) {
+    switch (t->Kind) {
+    case TermKind::Num:
+      return t->Data.Num;
+    case TermKind::Unit:
+    case TermKind::False:
+      return 0;
+    case TermKind::True:
+      return 1;
+    default:
+      return std::nullopt;
+    }
+  }
+
+  Lambda &lambda(Term *t) {
+    auto &f = *t->Data.Fn;
+    auto &fn =
+        VM.NewFunction("lambda", static_cast<uint32_t>(f.Params.Size), &f);
+    fn.Line = line(t);
+    Lambdas.push_back({&fn, t->Type, {}, Owner});
+    auto &lam = Lambdas.back();
+    std::vector<int> bound{};
+    elab::Captures(t, bound, lam.Captured);
+    fn.Captures = static_cast<uint32_t>(lam.Captured.size());
+    for (uint32_t i = 0; i < fn.Captures; i++) {
+      if (reference(lam.Captured[i]->Type)) {
+        fn.References.push_back(1 + i);
+      }
+    }
+    return lam;
+  }
+
+  // Parameters come first in the frame, then captured variables.
+  uint16_t variable(Term *t) {
+    auto id = t->Data.ID;
+    for (size_t i = 0; Fn->Body && i < Fn->Body->Params.Size; i++) {
+      if (Fn->Body->Params[i] == id) {
+        return static_cast<uint16_t>(i);
+      }
+    }
+    for (size_t i = 0; Captured && i < Captured->size(); i++) {
+      if ((*Captured)[i]->Data.ID == id) {
+        return static_cast<uint16_t>(Fn->Arity + i);
+      }
+    }
+    unreachable();
+  }
+
+  // Definitions and lambdas that capture nothing are one permanent closure
+  // each, other lambdas allocate a new one every time.
+  void closure(Term *t, uint16_t dst) {
+    uint32_t index;
+    const std::vector<Term *> *captured{};
+    if (t->Kind == TermKind::Def) {
+      index = VM.Image.FnOf.at(t->Data.ID);
+    } else {
+      auto &lam = lambda(t);
+      index = lam.Fn->Index;
+      captured = &lam.Captured;
+    }
+    auto n = captured ? static_cast<uint32_t>(captured->size()) : 0;
+    auto base = alloc(n);
+    for (uint32_t i = 0; i < n; i++) {
+      auto v = (*captured)[i];
+      emit(Op::Move, static_cast<uint16_t>(base + i), variable(v));
+      holds(base + i, v->Type);
+    }
+    if (n) {
+      safepoint();
+    }
+    emit(Op::Closure, dst, constant(index), base);
+    Top = base;
+  }
+
+  // Register holding t: variables are used in place, anything else is
+  // computed into dst.
+  uint16_t operand(Term *t, uint16_t dst) {
+    if (t->Kind == TermKind::Var) {
+      return variable(t);
+    }
+    expr(t, dst);
+    return dst;
+  }
+
+  std::optional<uint32_t> direct(Term *f) {
+    if (f->Kind != TermKind::Def) {
+      return std::nullopt;
+    }
+    auto it = VM.Image.FnOf.find(f->Data.ID);
+    if (it == VM.Image.FnOf.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  uint16_t args(const elab::App &a) {
+    auto base = alloc(static_cast<uint32_t>(a.Args.Size));
+    for (size_t i = 0; i < a.Args.Size; i++) {
+      expr(a.Args[i], static_cast<uint16_t>(base + i));
+    }
+    return base;
+  }
+
+  void expr(Term *t, uint16_t dst) {
+    auto saved = Line;
+    Line = line(t);
+    evaluate(t, dst);
+    Line = saved;
+  }
+
+  void tail(Term *t) {
+    auto saved = Line;
+    Line = line(t);
+    evaluateTail(t);
+    Line = saved;
+  }
+
+  void evaluate(Term *t, uint16_t dst) {
+    if (auto v = literal(t)) {
+      emit(Op::Const, dst, constant(*v));
+      holds(dst, t->Type);
+      return;
+    }
+    switch (t->Kind) {
+    case TermKind::Fn:
+      closure(t, dst);
+      break;
+    case TermKind::Ite: {
+      auto &ite = *t->Data.Ite;
+      auto toElse = jump(Op::JumpIfNot, operand(ite.If, dst));
+      // Only one branch runs, so the other's registers do not hold anything
+      // yet.
+      auto before = Holds;
+      expr(ite.Then, dst);
+      auto toEnd = jump(Op::Jump);
+      patch(toElse);
+      Holds = std::move(before);
+      expr(ite.Else, dst);
+      patch(toEnd);
+      break;
+    }
+    case TermKind::App: {
+      auto &a = *t->Data.App;
+      auto base = args(a);
+      if (auto fn = direct(a.F)) {
+        safepoint();
+        emit(Op::Call, dst, base, constant(*fn));
+      } else {
+        auto f = operand(a.F, alloc());
+        safepoint();
+        emit(Op::CallValue, dst, base, f);
+      }
+      Top = base;
+      break;
+    }
+    case TermKind::Var:
+      emit(Op::Move, dst, variable(t));
+      break;
+    case TermKind::Def:
+      if (direct(t)) {
+        closure(t, dst);
+      } else {
+        emit(Op::Global, dst, constant(VM.Image.GlobalOf.at(t->Data.ID)));
+      }
+      break;
+    default:
+      unreachable();
+    }
+    holds(dst, t->Type);
+  }
+
+  void evaluateTail(Term *t) {
+    if (auto v = literal(t)) {
+      emit(Op::ReturnConst, 0, constant(*v));
+      return;
+    }
+    switch (t->Kind) {
+    case TermKind::Ite: {
+      auto &ite = *t->Data.Ite;
+      auto tmp = alloc();
+      auto toElse = jump(Op::JumpIfNot, operand(ite.If, tmp));
+      Top = tmp;
+      tail(ite.Then);
+      patch(toElse);
+      tail(ite.Else);
+      return;
+    }
+    case TermKind::App: {
+      auto &a = *t->Data.App;
+      auto base = args(a);
+      auto fn = direct(a.F);
+      if (fn && *fn == Fn->Index) {
+        emit(Op::SelfTail, 0, base);
+      } else if (fn) {
+        safepoint();
+        emit(Op::CallReturn, 0, base, constant(*fn));
+      } else {
+        auto f = operand(a.F, alloc());
+        safepoint();
+        emit(Op::CallValueReturn, 0, base, f);
+      }
+      Top = base;
+      return;
+    }
+    case TermKind::Var:
+      emit(Op::Return, variable(t));
+      return;
+    default: {
+      auto dst = alloc();
+      expr(t, dst);
+      emit(Op::Return, dst);
+      return;
+    }
+    }
+  }
+
+  void begin(Function &fn, const std::vector<Term *> *captured) {
+    Fn = &fn;
+    Captured = captured;
+    Top = fn.Arity + fn.Captures;
+    fn.Regs = std::max(fn.Regs, Top);
+    Holds.assign(Top, false);
+    Pool.clear();
+  }
+
+  void function(Function &fn, Term *type, const std::vector<Term *> *captured) {
+    begin(fn, captured);
+    auto &params = Elab.Force(type)->Data.FnType->Params;
+    for (uint32_t i = 0; i < fn.Arity; i++) {
+      holds(i, params[i]);
+    }
+    for (uint32_t i = 0; i < fn.Captures; i++) {
+      holds(fn.Arity + i, (*captured)[i]->Type);
+    }
+    tail(fn.Body->Body);
+    fn.Finish();
+  }
+
+public:
+  std::string Error{};
+  const elab::Definition *Main{};
+  // Gives every instruction the line it comes from, out of the lines
+  // elaboration recorded. Set before defining anything.
+  bool Locate{};
+
+  Assembler(Machine &vm, elab::Elab &elab) : VM{vm}, Elab{elab} {}
+
+  void Declare(const elab::Definition &d) {
+    auto id = d.Def->ID;
+    if (d.Def->Kind == parsing::DefKind::Fn) {
+      auto &fn = VM.NewFunction(std::string{d.Name},
+                                static_cast<uint32_t>(d.Def->Params.Size),
+                                d.Body->Data.Fn);
+      VM.Image.FnOf[id] = fn.Index;
+    } else {
+      auto global = static_cast<uint32_t>(VM.Image.Globals.size());
+      VM.Image.GlobalOf[id] = global;
+      VM.Image.Globals.push_back(0);
+      if (reference(d.Type)) {
+        VM.Image.References.push_back(global);
+      }
+    }
+    if (d.Name == "main") {
+      Main = &d;
+    }
+  }
+
+  void Define(const elab::Definition &d) {
+    if (d.Def->Kind == parsing::DefKind::Fn) {
+      auto &fn = *VM.Image.Table[VM.Image.FnOf.at(d.Def->ID)];
+      Owner = &d;
+      Line = fn.Line = d.Line(d.Body);
+      function(fn, d.Type, nullptr);
+    }
+  }
+
+  // Builds the function that initializes all values in dependency order and
+  // then returns the value of main.
+  Function &Start(const std::vector<elab::Definition> &defs) {
+    auto &start = VM.NewFunction("start", 0, nullptr);
+    Owner = nullptr;
+    Line = 0;
+    begin(start, nullptr);
+    auto dst = alloc();
+    std::vector<const elab::Definition *> all{}, inits{};
+    for (auto &d : defs) {
+      all.push_back(&d);
+    }
+    if (auto cycle = elab::Initialization{all}.Order(all, inits)) {
+      Error = elab::Initialization::Cycle(*cycle);
+    }
+    for (auto d : inits) {
+      Owner = d;
+      Line = d->Line(d->Body);
+      expr(d->Body, dst);
+      emit(Op::SetGlobal, dst, constant(VM.Image.GlobalOf.at(d->Def->ID)));
+    }
+    Owner = Main;
+    Line = Main ? Main->Line(Main->Body) : 0;
+    if (Main && Main->Def->Kind == parsing::DefKind::Val) {
+      emit(Op::Global, dst, constant(VM.Image.GlobalOf.at(Main->Def->ID)));
+      emit(Op::Return, dst);
+    } else if (Main && Main->Def->Params.Size == 0) {
+      safepoint();
+      emit(Op::CallReturn, 0, dst,
+           constant(VM.Image.FnOf.at(Main->Def->ID)));
+    } else {
+      if (Main && Error.empty()) {
+        Error = "main must not take parameters";
+      }
+      emit(Op::ReturnConst, 0, constant(0));
+    }
+    start.Finish();
+    for (size_t i = 0; i < Lambdas.size(); i++) {
+      Owner = Lambdas[i].Owner;
+      Line = Lambdas[i].Fn->Line;
+      function(*Lambdas[i].Fn, Lambdas[i].Type, &Lambdas[i].Captured);
+    }
+    return start;
+  }
+};
+
+// Bytecode written by jian compile. Offsets are from the start of the file and
+// sections are 8-byte aligned, in host byte order, so that a loaded artifact
+// is one mapping the interpreter runs from in place. Only a descriptor per
+// function is created at load time.
+class Artifact {
+  static constexpr std::array<char, 4> Signature{{'J', 'I', 'A', 'N'}};
+  static constexpr uint32_t Layout = 2;
+  static constexpr uint32_t Endianness = 0x01020304;
+
+  struct Header {
+    std::array<char, 4> Magic;
+    uint32_t ByteOrder, Format, Version;
+    uint32_t Functions, Globals, Start, Result;
+    uint64_t Strings, StringsSize;
+    uint64_t References, ReferencesSize;
+  };
+
+  struct Record {
+    uint64_t Code, Constants, Safepoints, Live, References;
+    uint32_t CodeSize, ConstantsSize, SafepointsSize, LiveSize, ReferencesSize;
+    uint32_t Name, NameSize;
+    uint32_t Arity, Regs, Captures;
+  };
+
+  static constexpr uint32_t version() {
+    return static_cast<uint32_t>(JIAN_VERSION_MAJOR << 16 |
+                                 JIAN_VERSION_MINOR << 8 | JIAN_VERSION_PATCH);
+  }
+
+  const char *Data;
+  size_t Size;
+
+  Artifact(const char *data, size_t size) : Data{data}, Size{size} {}
+
+  template <typename T> const T *at(uint64_t offset, uint64_t n = 1) const {
+    if (offset % alignof(T) != 0 || offset > Size ||
+        n > (Size - offset) / sizeof(T)) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T *>(Data + offset);
+  }
+
+public:
+  Artifact(const Artifact &) = delete;
+  Artifact &operator=(const Artifact &) = delete;
+
+  ~Artifact() { munmap(const_cast<char *>(Data), Size); }
+
+  // Whether a file starts like an artifact rather than source text. Only
+  // regular files are looked at, artifacts are mapped and reading a pipe
+  // would take the script away from the front end.
+  static bool Sniff(const char *filename) {
+    struct stat st {};
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+      return false;
+    }
+    std::array<char, 4> magic{};
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+      return false;
+    }
+    auto n = fread(magic.data(), 1, magic.size(), f);
+    fclose(f);
+    return n == magic.size() && magic == Signature;
+  }
+
+  static bool Write(const Machine &vm, const Function &start,
+                    elab::TermKind result, const char *filename) {
+    auto &fns = vm.Image.Functions;
+    std::string out(sizeof(Header) + fns.size() * sizeof(Record), '\0');
+    auto align = [&out] { out.resize((out.size() + 7) & ~size_t{7}, '\0'); };
+    auto section = [&out, &align](const auto &xs, uint32_t &size) {
+      align();
+      auto at = out.size();
+      size = static_cast<uint32_t>(xs.size());
+      out.append(reinterpret_cast<const char *>(xs.data()),
+                 xs.size() * sizeof(xs[0]));
+      return at;
+    };
+
+    std::vector<Record> records(fns.size());
+    for (size_t i = 0; i < fns.size(); i++) {
+      auto &fn = *fns[i];
+      auto &r = records[i];
+      r.Arity = fn.Arity;
+      r.Regs = fn.Regs;
+      r.Captures = fn.Captures;
+      r.Code = section(fn.Code, r.CodeSize);
+      r.Constants = section(fn.Constants, r.ConstantsSize);
+      r.Safepoints = section(fn.Maps, r.SafepointsSize);
+      r.Live = section(fn.LiveRegs, r.LiveSize);
+      r.References = section(fn.References, r.ReferencesSize);
+    }
+    uint32_t references;
+    auto globals = section(vm.Image.References, references);
+
+    std::string strings{};
+    std::unordered_map<std::string_view, uint32_t> interned{};
+    for (size_t i = 0; i < fns.size(); i++) {
+      auto &name = fns[i]->Name;
+      auto it = interned.find(name);
+      if (it == interned.end()) {
+        it = interned.emplace(name, static_cast<uint32_t>(strings.size()))
+                 .first;
+        strings += name;
+      }
+      records[i].Name = it->second;
+      records[i].NameSize = static_cast<uint32_t>(name.size());
+    }
+    align();
+    Header h{Signature,
+             Endianness,
+             Layout,
+             version(),
+             static_cast<uint32_t>(fns.size()),
+             static_cast<uint32_t>(vm.Image.Globals.size()),
+             start.Index,
+             static_cast<uint32_t>(result),
+             out.size(),
+             strings.size(),
+             globals,
+             references};
+    out += strings;
+    memcpy(out.data(), &h, sizeof(h));
+    memcpy(out.data() + sizeof(h), records.data(),
+           records.size() * sizeof(Record));
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+      return false;
+    }
+    auto ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    return fclose(f) == 0 && ok;
+  }
+
+  // Maps an artifact and registers its functions with vm. Artifacts are
+  // trusted like executables, only their layout is checked.
+  static std::unique_ptr<Artifact> Load(Machine &vm, const char *filename,
+                                        std::string &error) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st {};
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      error = strerror(errno);
+      if (fd >= 0) {
+        close(fd);
+      }
+      return nullptr;
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    auto p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+      error = "cannot map artifact";
+      return nullptr;
+    }
+    std::unique_ptr<Artifact> a{new Artifact{static_cast<const char *>(p), size}};
+
+    auto h = a->at<Header>(0);
+    if (!h || h->Magic != Signature || h->ByteOrder != Endianness ||
+        h->Format != Layout) {
+      error = "not a bytecode artifact of this platform";
+      return nullptr;
+    }
+    if (h->Version != version()) {
+      error = "artifact built by another jian version";
+      return nullptr;
+    }
+    auto records = a->at<Record>(sizeof(Header), h->Functions);
+    auto strings = a->at<char>(h->Strings, h->StringsSize);
+    auto globals = a->at<uint32_t>(h->References, h->ReferencesSize);
+    if (!records || !strings || !globals || h->Start >= h->Functions) {
+      error = "corrupt artifact";
+      return nullptr;
+    }
+    for (uint32_t i = 0; i < h->Functions; i++) {
+      auto &r = records[i];
+      auto code = a->at<Instr>(r.Code, r.CodeSize);
+      auto constants = a->at<Value>(r.Constants, r.ConstantsSize);
+      auto safepoints = a->at<Safepoint>(r.Safepoints, r.SafepointsSize);
+      auto live = a->at<uint16_t>(r.Live, r.LiveSize);
+      auto refs = a->at<uint32_t>(r.References, r.ReferencesSize);
+      if (!code || !constants || !safepoints || !live || !refs ||
+          r.CodeSize == 0 || uint64_t{r.Name} + r.NameSize > h->StringsSize) {
+        error = "corrupt artifact";
+        return nullptr;
+      }
+      auto &fn = vm.NewFunction(std::string{strings + r.Name, r.NameSize},
+                                r.Arity, nullptr);
+      fn.Regs = r.Regs;
+      fn.Captures = r.Captures;
+      fn.Text = code;
+      fn.Length = r.CodeSize;
+      fn.Pool = constants;
+      fn.Safepoints = {safepoints, r.SafepointsSize};
+      fn.Live = {live, r.LiveSize};
+      fn.Shape.Pointers = {refs, r.ReferencesSize};
+    }
+    vm.Image.Globals.resize(h->Globals);
+    vm.Image.References.assign(globals, globals + h->ReferencesSize);
+    a->Start = vm.Image.Table[h->Start];
+    a->Result = static_cast<elab::TermKind>(h->Result);
+    return a;
+  }
+
+  Function *Start{};
+  elab::TermKind Result{};
+};
+
+} // namespace vm
+
+// Runtime of the shell DSL: external commands, alone or in pipelines. Commands
+// are started with posix_spawn, which never copies the address space of a
+// process with a large heap and JIT code, and neighbours in a pipeline are
+// joined by one pipe each, so data between them never passes through here.
+namespace shell {
+
+// A program looked up in PATH, with its arguments.
+using Command = std::vector<std::string>;
+
+class Pipeline {
+  // Reaped commands are left as -1.
+  std::vector<pid_t> Pids{};
+  // Raw status of the last command, once reaped.
+  int Last{};
+  int Read{-1};
+
+  static int status(int raw) {
+    if (WIFEXITED(raw)) {
+      return WEXITSTATUS(raw);
+    }
+    return WIFSIGNALED(raw) ? 128 + WTERMSIG(raw) : raw;
+  }
+
+  // Both ends close on exec. Without pipe2 another thread may spawn between
+  // creating the pipe and marking it, and leak it into that child.
+  static bool pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (::pipe(fds) != 0) {
+      return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+  }
+
+  static void close(int &fd) {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  // Starts one command reading from in and writing to out. Every other
+  // descriptor this side of a pipe is close-on-exec, so only those two are
+  // inherited.
+  bool spawn(const Command &cmd, int in, int out) {
+    if (cmd.empty()) {
+      Error = "empty command";
+      return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    if (in != STDIN_FILENO) {
+      posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (out != STDOUT_FILENO) {
+      posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+    // Commands expect default signal handling, whatever this process set up.
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGSEGV);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<char *> argv{};
+    for (auto &a : cmd) {
+      argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    auto err = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(),
+                            environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+      Error = cmd[0] + ": " + strerror(err);
+      return false;
+    }
+    Pids.push_back(pid);
+    return true;
+  }
+
+  // Reads what captured output is ready, or all of it if blocking, and
+  // closes the pipe at its end.
+  void drain(bool block) {
+    while (Read >= 0) {
+      auto n = Output->Append(Read);
+      if (n > 0 || (n < 0 && errno == EINTR)) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!block) {
+          return;
+        }
+        pollfd p{Read, POLLIN, 0};
+        poll(&p, 1, -1);
+        continue;
+      }
+      close(Read);
+    }
+  }
+
+  // Reaps the commands that have exited, or waits for all of them.
+  void reap(bool block) {
+    for (size_t i = 0; i < Pids.size(); i++) {
+      if (Pids[i] < 0) {
+        continue;
+      }
+      int raw = 0;
+      auto r = waitpid(Pids[i], &raw, block ? 0 : WNOHANG);
+      if (r < 0 && errno == EINTR) {
+        i--;
+        continue;
+      }
+      if (r == 0) {
+        continue;
+      }
+      if (r > 0 && i + 1 == Pids.size()) {
+        Last = raw;
+      }
+      Pids[i] = -1;
+    }
+  }
+
+public:
+  std::string Error{};
+  // What the last command wrote, if captured, as far as it has been read.
+  std::optional<parsing::Buffer> Output{};
+
+  Pipeline() = default;
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator=(const Pipeline &) = delete;
+
+  ~Pipeline() {
+    close(Read);
+    Wait();
+  }
+
+  // Starts every command at once, the first reading from in and the last
+  // writing to out, or into Output if out is negative. Commands started
+  // before a failure keep running and are waited for as usual.
+  bool Start(const std::vector<Command> &cmds, int in = STDIN_FILENO,
+             int out = STDOUT_FILENO) {
+    if (cmds.empty()) {
+      Error = "empty pipeline";
+      return false;
+    }
+    auto prev = in;
+    auto ok = true;
+    for (size_t i = 0; ok && i < cmds.size(); i++) {
+      auto last = i + 1 == cmds.size();
+      int fds[2] = {-1, -1};
+      if ((!last || out < 0) && !pipe(fds)) {
+        Error = std::string{"pipe: "} + strerror(errno);
+        ok = false;
+      } else {
+        ok = spawn(cmds[i], prev, last && out >= 0 ? out : fds[1]);
+      }
+      close(fds[1]);
+      if (prev != in) {
+        close(prev);
+      }
+      prev = fds[0];
+    }
+    if (ok && out < 0) {
+      Read = prev;
+      Output.emplace();
+    } else {
+      close(prev);
+    }
+    return ok;
+  }
+
+  // Started commands, for waiting on them by other means than Wait.
+  const std::vector<pid_t> &Processes() const { return Pids; }
+
+  // The read end of captured output until it is closed, which callers may
+  // make non-blocking and watch.
+  int Reader() const { return Read; }
+
+  // Reads and reaps whatever is ready without blocking, provided the reader
+  // is non-blocking. True once every command has exited and any captured
+  // output has ended.
+  bool Poll() {
+    drain(false);
+    reap(false);
+    return Read < 0 &&
+           std::all_of(Pids.begin(), Pids.end(), [](pid_t p) { return p < 0; });
+  }
+
+  // Reads any captured output to its end, then reaps every command, and
+  // returns the Status.
+  int Wait() {
+    drain(true);
+    reap(true);
+    return Status();
+  }
+
+  // The last command's, 128 plus the signal if one killed it, or 127 if not
+  // all of them started. Meaningful once Poll or Wait has finished.
+  int Status() const { return Error.empty() ? status(Last) : 127; }
+};
+
+// Runs pipelines side by side, at most Limit at once, like xargs -P. Jobs
+// start in the order they were added. On Linux one epoll instance waits both
+// for captured output and, through a pidfd per process, for commands to exit.
+// Elsewhere, or on kernels without pidfds, exits are noticed on a short tick.
+class Scheduler {
+  struct Job {
+    std::vector<Command> Commands;
+    bool Capture;
+    std::unique_ptr<shell::Pipeline> Pipeline{};
+    // A pidfd per process until it is reaped, or -1.
+    std::vector<int> Exits{};
+    bool Done{};
+  };
+
+  static constexpr int Tick = 5;
+
+  std::vector<Job> Jobs{};
+  std::vector<size_t> Running{};
+  size_t Limit;
+  // Some running process has no pidfd.
+  bool Ticking{};
+#ifdef __linux__
+  int Epoll{-1};
+#endif
+
+  static int pidfd(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    return -1;
+#endif
+  }
+
+  void watch(int fd, size_t job) {
+#ifdef __linux__
+    epoll_event e{};
+    e.events = EPOLLIN;
+    e.data.u64 = job;
+    epoll_ctl(Epoll, EPOLL_CTL_ADD, fd, &e);
+#else
+    (void)fd;
+    (void)job;
+#endif
+  }
+
+  void start(size_t i) {
+    auto &j = Jobs[i];
+    j.Pipeline = std::make_unique<shell::Pipeline>();
+    j.Pipeline->Start(j.Commands, STDIN_FILENO,
+                      j.Capture ? -1 : STDOUT_FILENO);
+    if (auto fd = j.Pipeline->Reader(); fd >= 0) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      watch(fd, i);
+    }
+    for (auto pid : j.Pipeline->Processes()) {
+      auto fd = pidfd(pid);
+      if (fd < 0) {
+        Ticking = true;
+      } else {
+        watch(fd, i);
+      }
+      j.Exits.push_back(fd);
+    }
+    Running.push_back(i);
+    step(i);
+  }
+
+  // Makes what progress job i can. A reaped process' pidfd stays readable,
+  // so it is closed, which also drops it from the epoll set.
+  void step(size_t i) {
+    auto &j = Jobs[i];
+    if (j.Done) {
+      return;
+    }
+    j.Done = j.Pipeline->Poll();
+    auto &pids = j.Pipeline->Processes();
+    for (size_t k = 0; k < j.Exits.size(); k++) {
+      if (pids[k] < 0 && j.Exits[k] >= 0) {
+        ::close(j.Exits[k]);
+        j.Exits[k] = -1;
+      }
+    }
+    if (j.Done) {
+      Running.erase(std::find(Running.begin(), Running.end(), i));
+    }
+  }
+
+  // The jobs that may have something to do.
+  std::vector<size_t> wait() {
+#ifdef __linux__
+    if (Epoll < 0) {
+      poll(nullptr, 0, Tick);
+      return Running;
+    }
+    std::array<epoll_event, 64> events{};
+    auto n = epoll_wait(Epoll, events.data(), static_cast<int>(events.size()),
+                        Ticking ? Tick : -1);
+    if (Ticking) {
+      return Running;
+    }
+    std::vector<size_t> ready{};
+    for (size_t k = 0; n > 0 && k < static_cast<size_t>(n); k++) {
+      ready.push_back(static_cast<size_t>(events[k].data.u64));
+    }
+    return ready;
+#else
+    std::vector<pollfd> fds{};
+    for (auto i : Running) {
+      if (auto fd = Jobs[i].Pipeline->Reader(); fd >= 0) {
+        fds.push_back({fd, POLLIN, 0});
+      }
+    }
+    poll(fds.data(), fds.size(), Tick);
+    return Running;
+#endif
+  }
+
+public:
+  explicit Scheduler(size_t limit = Pool::Cores())
+      : Limit{std::max<size_t>(limit, 1)} {}
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  // Queues a pipeline reading standard input and writing standard output, or
+  // into its Output if captured. Returns its index.
+  size_t Add(std::vector<Command> cmds, bool capture = false) {
+    Jobs.push_back({std::move(cmds), capture});
+    return Jobs.size() - 1;
+  }
+
+  // Runs every queued job to completion.
+  void Run() {
+#ifdef __linux__
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (Epoll < 0) {
+      Ticking = true;
+    }
+#endif
+    size_t next = 0;
+    while (true) {
+      while (Running.size() < Limit && next < Jobs.size()) {
+        start(next++);
+      }
+      if (Running.empty()) {
+        break;
+      }
+      for (auto i : wait()) {
+        step(i);
+      }
+    }
+#ifdef __linux__
+    if (Epoll >= 0) {
+      ::close(Epoll);
+      Epoll = -1;
+    }
+#endif
+  }
+
+  // A job that has run.
+  const Pipeline &operator[](size_t job) const { return *Jobs[job].Pipeline; }
+};
+
+} // namespace shell
+
+// Keeps a program checked while its files change, for editors and watchers.
+// Every file is tiled into chunks of text, one per definition, and an edit
+// only parses again the chunks it touches. A chunk remembers which globals it
+// looked up, and is only resolved again once one of them would be found
+// elsewhere. Types flow both ways along references, so the definitions that
+// refer to each other are elaborated together as a group, and only groups
+// reached by a change are.
+class Server {
+  // Text of one parse, with everything it owns, shared by the chunks it made.
+  struct Piece {
+    std::string Text;
+    parsing::Symbols Symbols{};
+    Arena Arena{};
+    parsing::Source Src;
+    parsing::Program Program{};
+
+    Piece(std::string text, parsing::IDs &ids)
+        : Text{std::move(text)}, Src{Text, ids, Symbols, Arena} {}
+  };
+
+  struct Chunk {
+    std::shared_ptr<struct Piece> Piece;
+    // Null for text with no definition, which either failed to parse or is
+    // blank.
+    parsing::Def *Def;
+    // Range in the file, and where it starts in the piece.
+    size_t Module, Start, End, Base;
+    bool Broken{};
+    // Resolved since parsed, which rewrites the definition in place.
+    bool Bound{}, Resolved{}, Duplicate{};
+    std::vector<resolving::Use> Uses{};
+    size_t Group{};
+    // First problem of each phase, spans within the piece.
+    parsing::Span BrokenAt{}, ResolutionAt{}, TypingAt{};
+    std::string Resolution{}, Typing{};
+  };
+
+  struct File {
+    const char *Name;
+    std::string Text{};
+    struct stat Stat {};
+    std::vector<std::unique_ptr<Chunk>> Chunks{};
+    // Offsets of line starts, for diagnostics.
+    std::vector<size_t> Lines{};
+  };
+
+  parsing::IDs IDs{};
+  std::vector<File> Files{};
+  resolving::Globals Globals{};
+  // Pieces the names in the globals are views into.
+  std::vector<std::shared_ptr<Piece>> Named{};
+  // Every definition by ID, and every group by number with the IDs in it.
+  std::unordered_map<int, Chunk *> Defs{};
+  std::unordered_map<size_t, std::vector<int>> Groups{};
+  size_t Next{};
+
+  // What changed since the last check: whether any top-level name was added,
+  // dropped or moved, which makes every lookup suspect, the chunks parsed,
+  // the chunks resolved, and groups that lost a definition.
+  bool Renamed{};
+  std::vector<Chunk *> Fresh{}, Changed{};
+  std::vector<size_t> Stale{};
+
+  // Chunks parsed together share a resolver.
+  std::optional<resolving::Resolver> Resolver{};
+  const Piece *Owner{};
+
+  static std::optional<std::string> read(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+      return std::nullopt;
+    }
+    std::string text{};
+    {
+      parsing::Buffer input{f};
+      text = input.View();
+    }
+    fclose(f);
+    return text;
+  }
+
+  static std::string_view name(const Chunk &c) {
+    return c.Piece->Symbols.Name(c.Def->Sym);
+  }
+
+  // Splits text starting at offset start of a file into chunks, one per
+  // definition, or a single one if it does not parse.
+  std::vector<std::unique_ptr<Chunk>> parse(std::string text, size_t module,
+                                            size_t start) {
+    auto piece = std::make_shared<Piece>(std::move(text), IDs);
+    auto size = piece->Text.size();
+    std::vector<std::unique_ptr<Chunk>> chunks{};
+    if (parsing::ParseProgram(piece->Program, piece->Src).Failed) {
+      auto pos = piece->Src.Where().Pos;
+      chunks.emplace_back(
+          new Chunk{piece, nullptr, module, start, start + size, 0});
+      chunks.back()->Broken = true;
+      chunks.back()->BrokenAt = {pos, pos};
+      return chunks;
+    }
+    auto &defs = piece->Program.Defs;
+    if (defs.empty()) {
+      chunks.emplace_back(
+          new Chunk{piece, nullptr, module, start, start + size, 0});
+    }
+    for (size_t i = 0; i < defs.size(); i++) {
+      auto from = i ? defs[i].Name.Start : 0;
+      auto to = i + 1 < defs.size() ? defs[i + 1].Name.Start : size;
+      chunks.emplace_back(new Chunk{piece, &defs[i], module, start + from,
+                                    start + to, from});
+    }
+    return chunks;
+  }
+
+  // Parses again the chunks an edit touches, and the one after, which may
+  // parse differently once what precedes it changed. Definitions keep their
+  // IDs and groups while their names stay, so references to them stay
+  // resolved.
+  void update(size_t module, std::string text) {
+    auto &f = Files[module];
+    auto &old = f.Text;
+    size_t prefix = 0, suffix = 0;
+    while (prefix < old.size() && prefix < text.size() &&
+           old[prefix] == text[prefix]) {
+      prefix++;
+    }
+    while (suffix < old.size() - prefix && suffix < text.size() - prefix &&
+           old[old.size() - 1 - suffix] == text[text.size() - 1 - suffix]) {
+      suffix++;
+    }
+    auto &cs = f.Chunks;
+    size_t first = 0;
+    while (first + 1 < cs.size() && cs[first]->End < prefix) {
+      first++;
+    }
+    auto last = first;
+    while (last < cs.size() && cs[last]->Start <= old.size() - suffix) {
+      last++;
+    }
+    last = std::min(last + 1, cs.size());
+    auto from = cs.empty() ? 0 : cs[first]->Start;
+    auto to = (cs.empty() ? old.size() : cs[last - 1]->End) + text.size() -
+              old.size();
+    auto chunks = parse(text.substr(from, to - from), module, from);
+    // A file that does not parse is one broken chunk, whatever was edited.
+    if (chunks[0]->Broken && (from != 0 || to != text.size())) {
+      first = 0;
+      last = cs.size();
+      chunks = parse(text, module, 0);
+    }
+
+    // The same names in the same places, as after most edits, leave every
+    // lookup as it was.
+    auto same = chunks.size() == last - first;
+    for (size_t k = 0; same && k < chunks.size(); k++) {
+      auto &o = *cs[first + k], &n = *chunks[k];
+      same = o.Def && n.Def && !o.Duplicate && name(o) == name(n);
+    }
+    Renamed |= !same;
+    std::unordered_map<std::string_view, Chunk *> kept{};
+    std::vector<Chunk *> gone{};
+    for (auto i = first; i < last; i++) {
+      if (cs[i]->Def && !kept.insert({name(*cs[i]), cs[i].get()}).second) {
+        gone.push_back(cs[i].get());
+      }
+    }
+    for (auto &c : chunks) {
+      if (!c->Def) {
+        continue;
+      }
+      auto it = kept.find(name(*c));
+      if (it != kept.end()) {
+        c->Def->ID = it->second->Def->ID;
+        c->Group = it->second->Group;
+        kept.erase(it);
+      }
+      Defs[c->Def->ID] = c.get();
+      Fresh.push_back(c.get());
+    }
+    for (auto &[_, c] : kept) {
+      gone.push_back(c);
+    }
+    for (auto c : gone) {
+      Defs.erase(c->Def->ID);
+      Stale.push_back(c->Group);
+    }
+
+    for (auto i = last; i < cs.size(); i++) {
+      cs[i]->Start = cs[i]->Start + text.size() - old.size();
+      cs[i]->End = cs[i]->End + text.size() - old.size();
+    }
+    auto at = cs.erase(cs.begin() + static_cast<ptrdiff_t>(first),
+                       cs.begin() + static_cast<ptrdiff_t>(last));
+    cs.insert(at, std::make_move_iterator(chunks.begin()),
+              std::make_move_iterator(chunks.end()));
+    f.Text = std::move(text);
+    f.Lines.assign(1, 0);
+    for (size_t i = 0; i < f.Text.size(); i++) {
+      if (f.Text[i] == '\n') {
+        f.Lines.push_back(i + 1);
+      }
+    }
+  }
+
+  // Returns whether any file changed.
+  bool load() {
+    bool changed = false;
+    for (size_t i = 0; i < Files.size(); i++) {
+      auto &f = Files[i];
+      struct stat st {};
+      if (stat(f.Name, &st) == 0 && !f.Chunks.empty() &&
+          st.st_size == f.Stat.st_size &&
+          st.st_mtim.tv_sec == f.Stat.st_mtim.tv_sec &&
+          st.st_mtim.tv_nsec == f.Stat.st_mtim.tv_nsec) {
+        continue;
+      }
+      f.Stat = st;
+      auto text = read(f.Name);
+      if (!text) {
+        perror("open file error");
+        text.emplace();
+      }
+      if (f.Chunks.empty() || *text != f.Text) {
+        update(i, std::move(*text));
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  // Position of a chunk in its file, which orders its lookups of names there.
+  size_t order(const Chunk &c) const {
+    auto &cs = Files[c.Module].Chunks;
+    auto it = std::lower_bound(
+        cs.begin(), cs.end(), c.Start,
+        [](const std::unique_ptr<Chunk> &x, size_t at) { return x->Start < at; });
+    return static_cast<size_t>(it - cs.begin());
+  }
+
+  void bind(Chunk &c, size_t order) {
+    if (Owner != c.Piece.get()) {
+      Owner = c.Piece.get();
+      Resolver.emplace(c.Piece->Symbols, &Globals, c.Module);
+    }
+    Resolver->Def(*c.Def, order);
+    c.Bound = true;
+    c.Uses = std::move(Resolver->Uses);
+    c.Resolved = Resolver->State == resolving::Resolution::OK;
+    c.Resolution.clear();
+    if (!c.Resolved) {
+      c.ResolutionAt = Resolver->NameSpan;
+      c.Resolution = std::string{"resolve error: "} +
+                     ToString(Resolver->State) + " \"" +
+                     std::string{Resolver->NameText} + '"';
+    }
+    Changed.push_back(&c);
+  }
+
+  // Resolves the chunks just parsed. Once names changed, the top-level names
+  // are collected again, and so is every chunk whose lookups would now find
+  // something else. Those were rewritten by the last resolution, so they are
+  // parsed again first.
+  void resolve() {
+    Owner = nullptr;
+    if (!Renamed) {
+      for (auto c : Fresh) {
+        bind(*c, order(*c));
+      }
+      return;
+    }
+    Globals = {};
+    Named.clear();
+    for (size_t i = 0; i < Files.size(); i++) {
+      std::unordered_map<std::string_view, size_t> seen{};
+      auto &cs = Files[i].Chunks;
+      for (size_t j = 0; j < cs.size(); j++) {
+        auto &c = *cs[j];
+        if (!c.Def) {
+          continue;
+        }
+        if (Named.empty() || Named.back() != c.Piece) {
+          Named.push_back(c.Piece);
+        }
+        auto duplicate = !seen.insert({name(c), j}).second ||
+                         !Globals.Add(name(c), c.Def->ID, i, j);
+        if (duplicate != c.Duplicate) {
+          c.Duplicate = duplicate;
+          Changed.push_back(&c);
+        }
+      }
+    }
+    for (size_t i = 0; i < Files.size(); i++) {
+      auto &f = Files[i];
+      for (size_t j = 0; j < f.Chunks.size(); j++) {
+        auto &c = *f.Chunks[j];
+        if (!c.Def || c.Duplicate) {
+          continue;
+        }
+        if (c.Bound &&
+            std::all_of(c.Uses.begin(), c.Uses.end(),
+                        [&](const resolving::Use &u) {
+                          return Globals.Lookup(u.Name, i, j).value_or(0) ==
+                                 u.ID;
+                        })) {
+          continue;
+        }
+        if (c.Bound) {
+          auto again =
+              parse(f.Text.substr(c.Start, c.End - c.Start), i, c.Start);
+          if (again.size() != 1 || !again[0]->Def) {
+            unreachable();
+          }
+          again[0]->Def->ID = c.Def->ID;
+          again[0]->Group = c.Group;
+          c = std::move(*again[0]);
+        }
+        bind(c, j);
+      }
+    }
+  }
+
+  // Elaborates again every group a change reaches: those of the changed
+  // definitions, of what they refer to now, and those that lost a definition.
+  // Everything that refers to a definition is in its group already, so the
+  // definitions reached split into groups of their own. Groups holding a
+  // definition that did not resolve are left alone, its error is the one to
+  // fix first.
+  size_t elaborate() {
+    std::unordered_map<int, size_t> reached{};
+    std::vector<Chunk *> nodes{};
+    std::vector<int> work{};
+    auto reach = [&](int id) {
+      if (reached.insert({id, SIZE_MAX}).second) {
+        work.push_back(id);
+      }
+    };
+    auto regroup = [&](size_t group) {
+      auto it = Groups.find(group);
+      if (it != Groups.end()) {
+        for (auto id : it->second) {
+          reach(id);
+        }
+        Groups.erase(it);
+      }
+    };
+    for (auto c : Changed) {
+      reach(c->Def->ID);
+    }
+    for (auto g : Stale) {
+      regroup(g);
+    }
+    while (!work.empty()) {
+      auto id = work.back();
+      work.pop_back();
+      auto it = Defs.find(id);
+      if (it == Defs.end()) {
+        continue;
+      }
+      auto c = it->second;
+      regroup(c->Group);
+      if (c->Duplicate) {
+        continue;
+      }
+      reached[id] = nodes.size();
+      nodes.push_back(c);
+      for (auto &u : c->Uses) {
+        reach(u.ID);
+      }
+    }
+
+    std::vector<size_t> parent(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+      parent[i] = i;
+    }
+    auto root = [&parent](size_t i) {
+      while (parent[i] != i) {
+        i = parent[i] = parent[parent[i]];
+      }
+      return i;
+    };
+    for (size_t i = 0; i < nodes.size(); i++) {
+      for (auto &u : nodes[i]->Uses) {
+        auto it = reached.find(u.ID);
+        if (it != reached.end() && it->second != SIZE_MAX) {
+          parent[root(i)] = root(it->second);
+        }
+      }
+    }
+    std::unordered_map<size_t, std::vector<Chunk *>> groups{};
+    for (size_t i = 0; i < nodes.size(); i++) {
+      groups[root(i)].push_back(nodes[i]);
+    }
+
+    size_t checked = 0;
+    for (auto &[_, members] : groups) {
+      std::sort(members.begin(), members.end(),
+                [](const Chunk *a, const Chunk *b) {
+                  return a->Module != b->Module ? a->Module < b->Module
+                                                : a->Start < b->Start;
+                });
+      auto group = ++Next;
+      auto &ids = Groups[group];
+      for (auto c : members) {
+        c->Group = group;
+        c->Typing.clear();
+        ids.push_back(c->Def->ID);
+      }
+      if (!std::all_of(members.begin(), members.end(),
+                       [](const Chunk *c) { return c->Resolved; })) {
+        continue;
+      }
+      checked += members.size();
+      Arena arena{};
+      elab::Table table{};
+      elab::Elab elab{arena, IDs, table};
+      for (auto c : members) {
+        elab.Declare(*c->Def);
+      }
+      for (auto c : members) {
+        elab.Module(c->Piece->Src);
+        elab.Define(*c->Def);
+        auto &st = elab.State;
+        if (st.Kind == elab::ElabStateKind::OK) {
+          continue;
+        }
+        c->TypingAt = st.Expr->Span;
+        c->Typing = st.Kind == elab::ElabStateKind::TooLarge
+                        ? "type error: number too large"
+                        : "type error: expected " + elab.ToString(st.Expected) +
+                              ", got " + elab.ToString(st.Got);
+        break;
+      }
+    }
+    return checked;
+  }
+
+  static void report(std::ostream &out, const File &f, const Chunk &c,
+                     const parsing::Span &span, const std::string &msg) {
+    auto offset = c.Start + span.Start - c.Base;
+    auto line = std::upper_bound(f.Lines.begin(), f.Lines.end(), offset) - 1;
+    out << f.Name << ':' << line - f.Lines.begin() + 1 << ':'
+        << offset - *line + 1 << ": " << msg << std::endl;
+  }
+
+  bool report(std::ostream &out) const {
+    bool ok = true;
+    for (auto &f : Files) {
+      for (auto &p : f.Chunks) {
+        auto &c = *p;
+        if (c.Broken) {
+          report(out, f, c, c.BrokenAt,
+                 "parse error (pos=" +
+                     std::to_string(c.Start + c.BrokenAt.Start) + ')');
+        } else if (c.Duplicate) {
+          report(out, f, c, c.Def->Name,
+                 std::string{"resolve error: "} +
+                     ToString(resolving::Resolution::Duplicate) + " \"" +
+                     std::string{name(c)} + '"');
+        } else if (!c.Resolution.empty()) {
+          report(out, f, c, c.ResolutionAt, c.Resolution);
+        } else if (!c.Typing.empty()) {
+          report(out, f, c, c.TypingAt, c.Typing);
+        } else {
+          continue;
+        }
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+public:
+  explicit Server(const std::vector<const char *> &files) {
+    for (auto f : files) {
+      Files.push_back({f});
+    }
+  }
+
+  // Checks the files once up front and again for every line of input, which
+  // editors send on save. Each round prints its errors, then a status line
+  // starting with ok or error.
+  int Serve(std::istream &in, std::ostream &out) {
+    for (std::string line{};;) {
+      size_t checked = 0;
+      if (load()) {
+        resolve();
+        checked = elaborate();
+        Renamed = false;
+        Fresh.clear();
+        Changed.clear();
+        Stale.clear();
+      }
+      out << (report(out) ? "ok" : "error") << " (elaborated " << checked
+          << " of " << Defs.size() << " definitions)" << std::endl;
+      if (!std::getline(in, line)) {
+        return 0;
+      }
+    }
+  }
+};
+
+class Driver {
+public:
+  struct Options {
+    bool Packrat{}, NoJIT{}, Eager{}, NoCache{}, TimePasses{}, Stats{};
+    bool Sampling{}, PerfMap{};
+    int Level{};
+  };
+
+private:
+  // One input file with everything its front end owns. Modules are parsed and
+  // resolved on pool threads, each touching only its own state.
+  class Module {
+    static FILE *open(const char *filename) {
+      if (strcmp(filename, "-") == 0) {
+        return stdin;
+      }
+      FILE *f = fopen(filename, "r");
+      if (!f) {
+        perror("open file error");
+        panic("create driver error");
+      }
+      return f;
+    }
+
+  public:
+    const char *Filename;
+    FILE *Infile;
+    parsing::Symbols Symbols{};
+    Arena Arena{};
+    parsing::Buffer Input;
+    parsing::Source Src;
+    parsing::Memo Memo{};
+    parsing::Program Program{};
+    std::string Error{};
+    // Of the globals while resolving.
+    size_t Lookups{};
+
+    Module(const char *file, parsing::IDs &ids)
+        : Filename{file}, Infile{open(file)}, Input{Infile},
+          Src{Input.View(), ids, Symbols, Arena, false} {}
+
+    Module(const Module &) = delete;
+    Module &operator=(const Module &) = delete;
+
+    ~Module() {
+      if (Infile == stdin) {
+        return;
+      }
+      int ret = fclose(Infile);
+      if (ret != 0) {
+        perror("close file error");
+        panic("close driver error");
+      }
     }
-    return c;
+
+    void Fail(const parsing::Span &span, const std::string &msg) {
+      auto loc = Src.LocOf(span.Start);
+      Error = std::string{Filename} + ':' + std::to_string(loc.Ln) + ':' +
+              std::to_string(loc.Col) + ": " + msg;
+    }
+
+    void Parse(bool packrat) {
+      if (packrat) {
+        Src.Memo = &Memo;
+      }
+      if (parsing::ParseProgram(Program, Src).Failed) {
+        auto loc = Src.Where();
+        Fail({loc.Pos, loc.Pos},
+             "parse error (pos=" + std::to_string(loc.Pos) + ')');
+      }
+    }
+
+    void Resolve(const resolving::Globals &globals, size_t index) {
+      resolving::Resolver resolver{Symbols, &globals, index};
+      resolver.Program(Program);
+      Lookups = resolver.Lookups;
+      if (resolver.State != resolving::Resolution::OK) {
+        Fail(resolver.NameSpan, std::string{"resolve error: "} +
+                                    ToString(resolver.State) + " \"" +
+                                    std::string{resolver.NameText} + '"');
+      }
+    }
+  };
+
+  // Whole lines of a script read from a pipe, the definitions in them parsed
+  // and resolved together. Only the definitions themselves outlive a batch.
+  struct Batch {
+    std::string Text;
+    // Where the text starts in the stream.
+    size_t Offset, Line;
+    parsing::Symbols Symbols{};
+    Arena Arena{};
+    parsing::Source Src;
+    parsing::Memo Memo{};
+    parsing::Program Program{};
+
+    Batch(std::string text, size_t offset, size_t line, parsing::IDs &ids)
+        : Text{std::move(text)}, Offset{offset}, Line{line},
+          Src{Text, ids, Symbols, Arena, false} {}
+
+    void Fail(size_t offset, const std::string &msg) const {
+      auto loc = Src.LocOf(offset);
+      std::cout << "-:" << Line + loc.Ln - 1 << ':' << loc.Col << ": " << msg
+                << std::endl;
+    }
+
+    // Parses definitions up to one that might go on past the text, unless the
+    // text is the rest of the stream, and returns how much of it they took.
+    std::optional<size_t> Parse(bool packrat, bool last) {
+      if (packrat) {
+        Src.Memo = &Memo;
+      }
+      while (true) {
+        Src.SkipSpaces();
+        if (Src.Peek().Kind == parsing::TokenKind::Eof) {
+          return Text.size();
+        }
+        auto saved = Src.Save();
+        auto start = Src.Peek().Offset;
+        auto size = Program.Defs.size();
+        Src.AtEnd = false;
+        parsing::ParseDef(Program, Src);
+        if (Src.AtEnd && !last) {
+          Program.Defs.resize(size);
+          Src.Back(saved);
+          return start;
+        }
+        if (Src.Failed) {
+          Fail(start, "parse error (pos=" + std::to_string(Offset + start) +
+                          ')');
+          return std::nullopt;
+        }
+      }
+    }
+  };
+
+  // Wall time and arena allocations per pass, and counters of the work done,
+  // for --time-passes and --stats. A pass run more than once, like for every
+  // batch of a stream, adds up.
+  class Profile {
+    struct Pass {
+      const char *Name;
+      double Millis;
+      size_t Allocations;
+    };
+
+    std::vector<Pass> Passes{};
+    std::vector<std::pair<const char *, size_t>> Counters{};
+
+  public:
+    void Time(const char *name, double millis, size_t allocations) {
+      for (auto &p : Passes) {
+        if (strcmp(p.Name, name) == 0) {
+          p.Millis += millis;
+          p.Allocations += allocations;
+          return;
+        }
+      }
+      Passes.push_back({name, millis, allocations});
+    }
+
+    void Count(const char *name, size_t n) {
+      for (auto &c : Counters) {
+        if (strcmp(c.first, name) == 0) {
+          c.second += n;
+          return;
+        }
+      }
+      Counters.emplace_back(name, n);
+    }
+
+    void Print(std::ostream &out) const {
+      char line[96];
+      double millis = 0;
+      size_t allocations = 0;
+      out << "pass                ms  allocations" << std::endl;
+      for (auto &p : Passes) {
+        snprintf(line, sizeof line, "%-10s %11.3f %12zu", p.Name, p.Millis,
+                 p.Allocations);
+        out << line << std::endl;
+        millis += p.Millis;
+        allocations += p.Allocations;
+      }
+      snprintf(line, sizeof line, "%-10s %11.3f %12zu", "total", millis,
+               allocations);
+      out << line << std::endl;
+      for (auto &c : Counters) {
+        snprintf(line, sizeof line, "%-22s %12zu", c.first, c.second);
+        out << line << std::endl;
+      }
+    }
+
+    void PrintJSON(std::ostream &out) const {
+      out << "{\"passes\":[";
+      for (size_t i = 0; i < Passes.size(); i++) {
+        auto &p = Passes[i];
+        out << (i ? "," : "") << "{\"name\":\"" << p.Name
+            << "\",\"ms\":" << p.Millis
+            << ",\"allocations\":" << p.Allocations << '}';
+      }
+      out << "],\"counters\":{";
+      for (size_t i = 0; i < Counters.size(); i++) {
+        out << (i ? "," : "") << '"' << Counters[i].first
+            << "\":" << Counters[i].second;
+      }
+      out << "}}" << std::endl;
+    }
+  };
+
+  std::vector<const char *> Filenames;
+  Options Opts;
+  class Profile Profile{};
+  parsing::IDs IDs{};
+  std::vector<std::unique_ptr<Module>> Modules{};
+  Arena Terms{};
+  elab::Table Table{};
+  // Of the elaborators checking groups of definitions in parallel.
+  std::vector<std::unique_ptr<Arena>> Arenas{};
+  std::vector<elab::Definition> Defs{};
+  // Where piped definitions are, by ID, for the profiler once their batch
+  // is gone.
+  std::unordered_map<int, std::string> Streamed{};
+
+  bool report() const {
+    bool ok = true;
+    for (auto &m : Modules) {
+      if (!m->Error.empty()) {
+        std::cout << m->Error << std::endl;
+        ok = false;
+      }
+    }
+    return ok;
   }
 
-  Source &Back(struct Loc loc) {
-    Loc = loc;
-    Failed = false;
-    return *this;
+  bool profiling() const { return Opts.TimePasses || Opts.Stats; }
+
+  // Everything the driver's arenas handed out so far, and extra's.
+  size_t allocations(const Arena *extra) const {
+    auto n = Terms.Allocations + Table.Allocations() +
+             (extra ? extra->Allocations : 0);
+    for (auto &m : Modules) {
+      n += m ? m->Arena.Allocations : 0;
+    }
+    for (auto &a : Arenas) {
+      n += a->Allocations;
+    }
+    return n;
   }
 
-  Source &Eat(char c) {
-    auto next = Next();
-    if (!next) {
-      Failed = true;
-      return *this;
+  // Runs f as the named pass, timed if a profile was asked for. Passes are
+  // never nested, or the inner one would be counted twice.
+  template <typename F>
+  auto timed(const char *name, F &&f, const Arena *extra = nullptr) {
+    struct Stop {
+      Driver &D;
+      const char *Name;
+      const Arena *Extra;
+      size_t Allocations;
+      std::chrono::steady_clock::time_point Start;
+
+      ~Stop() {
+        std::chrono::duration<double, std::milli> took{
+            std::chrono::steady_clock::now() - Start};
+        D.Profile.Time(Name, took.count(),
+                       D.allocations(Extra) - Allocations);
+      }
+    };
+    if (!profiling()) {
+      return f();
     }
-    Failed = next.value() != c;
-    return *this;
+    Stop stop{*this, name, extra, allocations(extra),
+              std::chrono::steady_clock::now()};
+    return f();
   }
 
-  Source &SkipSpaces() {
-    while (true) {
-      auto peek = Peek();
-      if (!peek) {
-        break;
+  static size_t nodes(const parsing::Expr &e) {
+    size_t n = 1;
+    switch (e.Kind) {
+    case parsing::ExprKind::App:
+      n += nodes(e.Data.App->F);
+      for (auto &a : e.Data.App->Args) {
+        n += nodes(a);
       }
-      auto c = peek.value();
-      if ((NewlineSensitive && c == '\n') || !isspace(c)) {
-        break;
+      break;
+    case parsing::ExprKind::Ite:
+      n += nodes(e.Data.Ite->If) + nodes(e.Data.Ite->Then) +
+           nodes(e.Data.Ite->Else);
+      break;
+    case parsing::ExprKind::Lam:
+      n += nodes(e.Data.Lam->Body);
+      break;
+    default:
+      break;
+    }
+    return n;
+  }
+
+  // What parsing one input took besides time.
+  void counted(const parsing::Symbols &symbols, const parsing::Source &src,
+               const parsing::Memo &memo, const parsing::Program &program) {
+    if (!profiling()) {
+      return;
+    }
+    size_t n = 0;
+    for (auto &d : program.Defs) {
+      n += nodes(d.Ret);
+    }
+    Profile.Count("ast_nodes", n);
+    Profile.Count("parse_backtracks", src.Backtracks);
+    Profile.Count("memo_hits", memo.Hits);
+    Profile.Count("symbol_probes", symbols.Probes);
+  }
+
+  // Calls f with the ID of every name e refers to.
+  template <typename F> static void references(const parsing::Expr &e, F &f) {
+    switch (e.Kind) {
+    case parsing::ExprKind::Resolved:
+      f(e.Data.ID);
+      return;
+    case parsing::ExprKind::App:
+      references(e.Data.App->F, f);
+      for (auto &a : e.Data.App->Args) {
+        references(a, f);
       }
-      Eat(c);
+      return;
+    case parsing::ExprKind::Ite:
+      references(e.Data.Ite->If, f);
+      references(e.Data.Ite->Then, f);
+      references(e.Data.Ite->Else, f);
+      return;
+    case parsing::ExprKind::Lam:
+      references(e.Data.Lam->Body, f);
+      return;
+    default:
+      return;
     }
-    return *this;
   }
-};
 
-} // namespace parsing
+  // Checks every definition, in groups that refer to each other and in
+  // parallel across groups. A type is only inferred from the uses within its
+  // group, so groups are independent. Each group is checked in command-line
+  // order and stops at its first error, and the first error in command-line
+  // order is the one reported: the same as checking everything in order.
+  void elaborate() {
+    struct At {
+      size_t Module;
+      const parsing::Def *Def;
+    };
+    std::vector<At> defs{};
+    std::unordered_map<int, size_t> index{};
+    for (size_t i = 0; i < Modules.size(); i++) {
+      for (auto &d : Modules[i]->Program.Defs) {
+        index.emplace(d.ID, defs.size());
+        defs.push_back({i, &d});
+      }
+    }
 
-class Driver {
-  const char *Filename;
-  FILE *Infile;
-  parsing::IDs IDs{};
+    std::vector<size_t> parent(defs.size());
+    for (size_t i = 0; i < defs.size(); i++) {
+      parent[i] = i;
+    }
+    auto root = [&parent](size_t i) {
+      while (parent[i] != i) {
+        i = parent[i] = parent[parent[i]];
+      }
+      return i;
+    };
+    for (size_t i = 0; i < defs.size(); i++) {
+      auto unite = [&](int id) {
+        auto it = index.find(id);
+        if (it != index.end()) {
+          parent[root(i)] = root(it->second);
+        }
+      };
+      references(defs[i].Def->Ret, unite);
+    }
+    std::vector<size_t> group(defs.size(), SIZE_MAX);
+    std::vector<std::vector<size_t>> groups{};
+    for (size_t i = 0; i < defs.size(); i++) {
+      auto &g = group[root(i)];
+      if (g == SIZE_MAX) {
+        g = groups.size();
+        groups.emplace_back();
+      }
+      groups[g].push_back(i);
+    }
+
+    // Consecutive groups make up one task, large enough to be worth a thread
+    // but small enough for the pool to balance.
+    auto cores = Pool::Cores();
+    auto target = std::max<size_t>(256, defs.size() / (4 * cores));
+    std::vector<std::pair<size_t, size_t>> tasks{};
+    for (size_t g = 0, size = 0; g < groups.size(); g++) {
+      if (tasks.empty() || size >= target) {
+        tasks.push_back({g, g});
+        size = 0;
+      }
+      tasks.back().second = g + 1;
+      size += groups[g].size();
+    }
+
+    struct Failure {
+      size_t At;
+      parsing::Span Span;
+      std::string Message;
+    };
+    Defs.resize(defs.size());
+    std::vector<std::optional<Failure>> failures(tasks.size());
+    for (size_t i = 0; i < tasks.size(); i++) {
+      Arenas.push_back(std::make_unique<Arena>());
+    }
+    // Lines are computed on first use, so not by tasks sharing a module.
+    if (Opts.Sampling) {
+      for (auto &m : Modules) {
+        m->Src.LocOf(0);
+      }
+    }
+    auto check = [&](size_t task) {
+      elab::Elab elab{*Arenas[task], IDs, Table};
+      elab.Locate = Opts.Sampling;
+      auto &failure = failures[task];
+      for (auto g = tasks[task].first; g < tasks[task].second; g++) {
+        for (auto i : groups[g]) {
+          elab.Declare(*defs[i].Def);
+        }
+        elab.State = {};
+        for (auto i : groups[g]) {
+          elab.Module(Modules[defs[i].Module]->Src);
+          Defs[i] = elab.Define(*defs[i].Def);
+          auto &st = elab.State;
+          if (st.Kind == elab::ElabStateKind::OK) {
+            continue;
+          }
+          if (!failure || i < failure->At) {
+            failure = {i, st.Expr->Span,
+                       st.Kind == elab::ElabStateKind::TooLarge
+                           ? "type error: number too large"
+                           : "type error: expected " +
+                                 elab.ToString(st.Expected) + ", got " +
+                                 elab.ToString(st.Got)};
+          }
+          break;
+        }
+      }
+    };
+    if (tasks.size() == 1) {
+      check(0);
+    } else {
+      Pool pool{std::min(cores, tasks.size())};
+      for (size_t i = 0; i < tasks.size(); i++) {
+        pool.Submit([&check, i] { check(i); });
+      }
+      pool.Wait();
+    }
+
+    const Failure *first = nullptr;
+    for (auto &f : failures) {
+      if (f && (!first || f->At < first->At)) {
+        first = &*f;
+      }
+    }
+    if (first) {
+      Modules[defs[first->At].Module]->Fail(first->Span, first->Message);
+    }
+  }
+
+  static void print(elab::TermKind result, long long v) {
+    switch (result) {
+    case elab::TermKind::NumType:
+      std::cout << v << std::endl;
+      break;
+    case elab::TermKind::BoolType:
+      std::cout << (v ? "true" : "false") << std::endl;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // What main produces, unit without a main.
+  elab::TermKind result(elab::Elab &elab) const {
+    for (auto &d : Defs) {
+      if (d.Name == "main") {
+        return elab.Result(d)->Kind;
+      }
+    }
+    return elab::TermKind::UnitType;
+  }
+
+  // Keyed by the compiler and the exact bytes of every module in order.
+  std::optional<codegen::Cache> cache() const {
+    if (Opts.NoCache) {
+      return std::nullopt;
+    }
+    auto cache = codegen::Cache::Open();
+    if (cache) {
+      cache->Add(std::to_string(JIAN_VERSION_MAJOR) + '.' +
+                 std::to_string(JIAN_VERSION_MINOR) + '.' +
+                 std::to_string(JIAN_VERSION_PATCH));
+#ifdef LIBGCCJIT_HAVE_gcc_jit_version
+      cache->Add(std::to_string(gcc_jit_version_major()) + '.' +
+                 std::to_string(gcc_jit_version_minor()) + '.' +
+                 std::to_string(gcc_jit_version_patchlevel()));
+#endif
+      cache->Add("-O" + std::to_string(Opts.Level));
+      for (auto &m : Modules) {
+        cache->Add(m->Input.View());
+      }
+    }
+    return cache;
+  }
+
+  // Compiles the whole program to native code before running it. The code is
+  // kept in the cache, later runs of the same sources only load it. Programs
+  // with capturing lambdas cannot be compiled ahead and run tiered instead.
+  int compile(elab::Elab &elab) {
+    auto cache = this->cache();
+    if (cache) {
+      if (auto lib = load(*cache)) {
+        print(result(elab), timed("run", [&] { return lib->Run(); }));
+        return 0;
+      }
+    }
+    codegen::JIT jit{elab, Opts.Level};
+    jit.Visible = Opts.Sampling || Opts.PerfMap;
+    auto built = timed("codegen", [&] {
+      for (auto &d : Defs) {
+        jit.Declare(d);
+      }
+      for (auto &d : Defs) {
+        jit.Define(d);
+      }
+      return jit.Build();
+    });
+    if (!built && jit.Closures) {
+      return interpret(elab);
+    }
+    if (!built) {
+      std::cout << "jit error: " << jit.Error << std::endl;
+      return -1;
+    }
+    if (cache &&
+        timed("compile", [&] { return jit.CompileTo(cache->Path()); })) {
+      if (auto lib = load(*cache)) {
+        print(result(elab), timed("run", [&] { return lib->Run(); }));
+        return 0;
+      }
+    }
+    if (!timed("compile", [&] { return jit.Compile(); })) {
+      std::cout << "jit error: " << jit.Error << std::endl;
+      return -1;
+    }
+    std::optional<vm::Sampler> sampler{};
+    print(result(elab), timed("run", [&] {
+            if (Opts.Sampling) {
+              sampler.emplace(nullptr);
+            }
+            auto ret = jit.Run();
+            if (sampler) {
+              sampler->Stop();
+            }
+            return ret;
+          }));
+    if (sampler) {
+      printSamples(*sampler, nullptr);
+    }
+    return 0;
+  }
+
+  std::unique_ptr<codegen::Library> load(const codegen::Cache &cache) {
+    return timed("load", [&] { return codegen::Library::Open(cache.Path()); });
+  }
+
+  // Starts in the interpreter, so no compile latency is paid up front, unless
+  // an eager run already left the program in the cache. With --no-jit only
+  // bytecode runs, so the cache is not looked at.
+  int interpret(elab::Elab &elab) {
+    if (auto cache = Opts.NoJIT ? std::nullopt : this->cache()) {
+      if (auto lib = load(*cache)) {
+        print(result(elab), timed("run", [&] { return lib->Run(); }));
+        return 0;
+      }
+    }
+    vm::Machine machine{!Opts.NoJIT};
+    auto start = timed("codegen", [&] { return assemble(machine, elab); });
+    if (!start) {
+      return -1;
+    }
+    std::optional<vm::Sampler> sampler{};
+    print(result(elab), timed("run", [&] {
+            if (Opts.Sampling) {
+              sampler.emplace(&machine);
+            }
+            auto ret = machine.Run(*start);
+            if (sampler) {
+              sampler->Stop();
+            }
+            return ret;
+          }));
+    if (sampler) {
+      printSamples(*sampler, &machine);
+    }
+    Profile.Count("gc_minor", machine.Heap.Minors);
+    Profile.Count("gc_major", machine.Heap.Majors);
+    return 0;
+  }
+
+  // Where each function of the program comes from: a definition by its name
+  // and line, a lambda by the definition it is written in.
+  std::unordered_map<const elab::Fn *, std::string> labels() const {
+    std::unordered_map<const elab::Fn *, std::string> labels{};
+    for (auto &d : Defs) {
+      auto streamed = Streamed.find(d.Def->ID);
+      std::string where{streamed == Streamed.end() ? "" : streamed->second};
+      for (auto &m : Modules) {
+        auto &defs = m->Program.Defs;
+        std::less<const parsing::Def *> before{};
+        if (!defs.empty() && !before(d.Def, defs.data()) &&
+            before(d.Def, defs.data() + defs.size())) {
+          where = std::string{m->Filename} + ':' +
+                  std::to_string(m->Src.LocOf(d.Def->Name.Start).Ln);
+        }
+      }
+      auto name =
+          std::string{d.Name} + (where.empty() ? "" : " (" + where + ')');
+      std::vector<const elab::Term *> work{d.Body};
+      while (!work.empty()) {
+        auto t = work.back();
+        work.pop_back();
+        switch (t->Kind) {
+        case elab::TermKind::Fn:
+          labels.emplace(t->Data.Fn, t == d.Body ? name : "lambda in " + name);
+          work.push_back(t->Data.Fn->Body);
+          break;
+        case elab::TermKind::Ite:
+          work.push_back(t->Data.Ite->If);
+          work.push_back(t->Data.Ite->Then);
+          work.push_back(t->Data.Ite->Else);
+          break;
+        case elab::TermKind::App:
+          work.push_back(t->Data.App->F);
+          for (auto a : t->Data.App->Args) {
+            work.push_back(a);
+          }
+          break;
+        default:
+          break;
+        }
+      }
+    }
+    return labels;
+  }
+
+  // Writes the share of samples per function to standard error, split by
+  // whether the function was running native code or interpreted, and under
+  // each function the share per line. Native code is found by address and
+  // counts for the line the function starts on. Everything else is found by
+  // the innermost frame of vm, and counts for the line of the last call or
+  // allocation the frame made.
+  void printSamples(const vm::Sampler &sampler, const vm::Machine *vm) const {
+    struct Row {
+      size_t Native, Interpreted;
+    };
+    auto total = [](const Row &r) { return r.Native + r.Interpreted; };
+    auto labels = this->labels();
+    auto label = [&](const elab::Fn *fn, const std::string &otherwise) {
+      auto it = fn ? labels.find(fn) : labels.end();
+      return it == labels.end() ? otherwise : it->second;
+    };
+    std::unordered_set<const vm::Function *> functions{};
+    if (vm) {
+      for (auto &f : vm->Image.Functions) {
+        functions.insert(f.get());
+      }
+    }
+    // The line of the instruction at, if the function has lines.
+    auto line = [](const vm::Function &f, const vm::Instr *at) {
+      if (!at || f.Lines.size() != f.Length ||
+          std::less<const vm::Instr *>{}(at, f.Text) ||
+          !std::less<const vm::Instr *>{}(at, f.Text + f.Length)) {
+        return f.Line;
+      }
+      return f.Lines[static_cast<size_t>(at - f.Text)];
+    };
+    std::unordered_map<std::string, Row> rows{};
+    std::unordered_map<std::string, std::unordered_map<uint32_t, Row>> lines{};
+    auto samples = sampler.Samples();
+    for (auto &s : samples) {
+      if (auto r = codegen::CodeMap::Get().Find(s.Pc)) {
+        auto name = label(r->Fn, r->Symbol);
+        rows[name].Native++;
+        lines[name][r->Line].Native++;
+      } else if (s.Fn && functions.count(s.Fn)) {
+        auto name = label(s.Fn->Body, s.Fn->Name);
+        rows[name].Interpreted++;
+        lines[name][line(*s.Fn, s.At)].Interpreted++;
+      } else {
+        rows["(other)"].Interpreted++;
+      }
+    }
+    std::vector<std::pair<std::string, Row>> sorted{rows.begin(), rows.end()};
+    std::sort(sorted.begin(), sorted.end(), [&](auto &a, auto &b) {
+      auto x = total(a.second), y = total(b.second);
+      return x != y ? x > y : a.first < b.first;
+    });
+    fprintf(stderr, "%zu samples every %d us", samples.Size,
+            vm::Sampler::Interval);
+    if (sampler.Dropped()) {
+      fprintf(stderr, ", %zu dropped", sampler.Dropped());
+    }
+    fprintf(stderr, "\n%7s %8s %8s  %s\n", "share", "native", "interp",
+            "function, line");
+    auto print = [&](const Row &row, const std::string &what) {
+      fprintf(stderr, "%6.1f%% %8zu %8zu  %s\n",
+              100.0 * static_cast<double>(total(row)) /
+                  static_cast<double>(samples.Size),
+              row.Native, row.Interpreted, what.c_str());
+    };
+    for (auto &[name, row] : sorted) {
+      print(row, name);
+      auto &in = lines[name];
+      std::vector<std::pair<uint32_t, Row>> by{in.begin(), in.end()};
+      std::sort(by.begin(), by.end(), [&](auto &a, auto &b) {
+        auto x = total(a.second), y = total(b.second);
+        return x != y ? x > y : a.first < b.first;
+      });
+      for (auto &[at, count] : by) {
+        if (at) {
+          print(count, "  line " + std::to_string(at));
+        }
+      }
+    }
+  }
+
+  vm::Function *assemble(vm::Machine &machine, elab::Elab &elab) {
+    vm::Assembler assembler{machine, elab};
+    assembler.Locate = Opts.Sampling;
+    for (auto &d : Defs) {
+      assembler.Declare(d);
+    }
+    for (auto &d : Defs) {
+      assembler.Define(d);
+    }
+    auto &start = assembler.Start(Defs);
+    if (!assembler.Error.empty()) {
+      std::cout << "bytecode error: " << assembler.Error << std::endl;
+      return nullptr;
+    }
+    return &start;
+  }
+
+  // Parses, resolves and checks all modules in parallel. The only sequential
+  // steps are collecting top-level names, which modules need to see each
+  // other, and grouping definitions by what they refer to.
+  bool check() {
+    Modules.resize(Filenames.size());
+    Pool pool{std::min(Pool::Cores(), Filenames.size())};
+
+    timed("read", [&] {
+      for (size_t i = 0; i < Filenames.size(); i++) {
+        pool.Submit([this, i] {
+          Modules[i] = std::make_unique<Module>(Filenames[i], IDs);
+        });
+      }
+      pool.Wait();
+    });
+    timed("lex", [&] {
+      for (auto &m : Modules) {
+        pool.Submit([&m] { m->Src.Scan(); });
+      }
+      pool.Wait();
+    });
+    timed("parse", [&] {
+      for (auto &m : Modules) {
+        pool.Submit([this, &m] { m->Parse(Opts.Packrat); });
+      }
+      pool.Wait();
+    });
+    for (auto &m : Modules) {
+      counted(m->Symbols, m->Src, m->Memo, m->Program);
+    }
+    if (!report()) {
+      return false;
+    }
+
+    resolving::Globals globals{};
+    timed("resolve", [&] {
+      for (size_t i = 0; i < Modules.size(); i++) {
+        auto &m = *Modules[i];
+        for (auto &d : m.Program.Defs) {
+          auto name = m.Symbols.Name(d.Sym);
+          if (!globals.Add(name, d.ID, i)) {
+            m.Fail(d.Name, std::string{"resolve error: "} +
+                               ToString(resolving::Resolution::Duplicate) +
+                               " \"" + std::string{name} + '"');
+            break;
+          }
+        }
+      }
+    });
+    if (!report()) {
+      return false;
+    }
+
+    timed("resolve", [&] {
+      for (size_t i = 0; i < Modules.size(); i++) {
+        pool.Submit([this, i, &globals] { Modules[i]->Resolve(globals, i); });
+      }
+      pool.Wait();
+    });
+    for (auto &m : Modules) {
+      Profile.Count("global_lookups", m->Lookups);
+    }
+    if (!report()) {
+      return false;
+    }
+
+    timed("elaborate", [&] { elaborate(); });
+    return report();
+  }
+
+  // Runs a script piped to standard input as it arrives. Definitions are
+  // parsed, resolved and checked as they come, and main runs as soon as it is
+  // checked, with only the definitions it reaches. Inference has no later
+  // uses to learn from at that point, so types still unknown then are unit,
+  // as they are at the end of a whole file. Until then every checked
+  // definition is kept, since main may use any of them; once main has run
+  // they are all released, and the rest of the input is only parsed, one
+  // read at a time.
+  int stream() {
+    static constexpr size_t Block = 64 * 1024;
+    Opts.NoCache = true;
+    resolving::Globals globals{};
+    Arena names{};
+    std::deque<parsing::Def> kept{};
+    elab::Elab elab{Terms, IDs, Table};
+    elab.Locate = Opts.Sampling;
+    std::string pending{};
+    std::vector<char> block(Block);
+    // What pending must grow to before a definition that did not fit is
+    // lexed again, unless the input stalls, so that a long one is not lexed
+    // once per block.
+    size_t offset = 0, line = 1, batches = 0, retry = 0;
+    bool ran = false;
+    auto stalled = [] {
+      pollfd p{STDIN_FILENO, POLLIN, 0};
+      return poll(&p, 1, 0) == 0;
+    };
+    for (auto last = false; !last;) {
+      auto n = read(STDIN_FILENO, block.data(), block.size());
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("read file error");
+        return -1;
+      }
+      last = n == 0;
+      pending.append(block.data(), static_cast<size_t>(n));
+      auto cut = last ? pending.size() : pending.rfind('\n') + 1;
+      if (cut == 0 || (!last && pending.size() < retry && !stalled())) {
+        continue;
+      }
+
+      Batch b{pending.substr(0, cut), offset, line, IDs};
+      timed("lex", [&] { b.Src.Scan(); });
+      auto used = timed(
+          "parse", [&] { return b.Parse(Opts.Packrat, last); }, &b.Arena);
+      if (!used) {
+        return -1;
+      }
+      counted(b.Symbols, b.Src, b.Memo, b.Program);
+      retry = *used ? 0 : 2 * pending.size();
+      auto advance = [&] {
+        offset += *used;
+        line += static_cast<size_t>(std::count(
+            pending.begin(), pending.begin() + static_cast<long>(*used),
+            '\n'));
+        pending.erase(0, *used);
+      };
+      // Nothing after main can run, the rest is only parsed.
+      if (ran) {
+        advance();
+        continue;
+      }
+      auto module = batches++;
+      std::vector<std::string_view> keys{};
+      auto resolved = timed(
+          "resolve",
+          [&] {
+            for (auto &d : b.Program.Defs) {
+              auto name = b.Symbols.Name(d.Sym);
+              auto copy = names.NewArray<char>(name.size());
+              std::copy(name.begin(), name.end(), copy);
+              std::string_view key{copy, name.size()};
+              if (!globals.Add(key, d.ID, module)) {
+                b.Fail(d.Name.Start,
+                       std::string{"resolve error: "} +
+                           ToString(resolving::Resolution::Duplicate) +
+                           " \"" + std::string{name} + '"');
+                return false;
+              }
+              keys.push_back(key);
+            }
+            resolving::Resolver resolver{b.Symbols, &globals, module};
+            resolver.Program(b.Program);
+            Profile.Count("global_lookups", resolver.Lookups);
+            if (resolver.State != resolving::Resolution::OK) {
+              b.Fail(resolver.NameSpan.Start,
+                     std::string{"resolve error: "} +
+                         ToString(resolver.State) + " \"" +
+                         std::string{resolver.NameText} + '"');
+              return false;
+            }
+            return true;
+          },
+          &b.Arena);
+      if (!resolved) {
+        return -1;
+      }
+
+      elab.Module(b.Src, static_cast<uint32_t>(b.Line));
+      for (size_t i = 0; i < b.Program.Defs.size(); i++) {
+        auto &d = kept.emplace_back(b.Program.Defs[i]);
+        auto params = Terms.NewArray<parsing::Param>(d.Params.Size);
+        std::copy(d.Params.begin(), d.Params.end(), params);
+        d.Params.Data = params;
+        auto def = timed("elaborate", [&] {
+          elab.Declare(d);
+          return elab.Define(d);
+        });
+        def.Name = keys[i];
+        auto &st = elab.State;
+        if (st.Kind != elab::ElabStateKind::OK) {
+          b.Fail(st.Expr->Span.Start,
+                 st.Kind == elab::ElabStateKind::TooLarge
+                     ? "type error: number too large"
+                     : "type error: expected " + elab.ToString(st.Expected) +
+                           ", got " + elab.ToString(st.Got));
+          return -1;
+        }
+        d.Ret = {};
+        if (Opts.Sampling) {
+          Streamed[d.ID] =
+              "-:" + std::to_string(b.Line + b.Src.LocOf(d.Name.Start).Ln - 1);
+        }
+        Defs.push_back(def);
+        if (def.Name == "main") {
+          Defs = elab::Reachable(Defs, Defs.back());
+          if (auto ret = Opts.Eager ? compile(elab) : interpret(elab)) {
+            return ret;
+          }
+          Defs.clear();
+          kept.clear();
+          globals = {};
+          names.Rollback({});
+          Terms.Rollback({});
+          ran = true;
+          break;
+        }
+      }
+      advance();
+    }
+    if (!ran) {
+      return Opts.Eager ? compile(elab) : interpret(elab);
+    }
+    return 0;
+  }
+
+  static bool piped(const char *filename) {
+    struct stat st {};
+    return strcmp(filename, "-") == 0 && fstat(STDIN_FILENO, &st) == 0 &&
+           !S_ISREG(st.st_mode);
+  }
 
 public:
-  explicit Driver(const char *file) : Filename{file} {
-    Infile = fopen(Filename, "r");
-    if (!Infile) {
-      perror("open file error");
-      panic("create driver error");
+  Driver(std::vector<const char *> files, Options opts)
+      : Filenames{std::move(files)}, Opts{opts} {}
+
+  int RunScript() {
+    if (Filenames.size() == 1 && piped(Filenames[0])) {
+      return stream();
+    }
+    elab::Elab elab{Terms, IDs, Table};
+    if (!check()) {
+      return -1;
+    }
+    if (Opts.PerfMap && !codegen::CodeMap::Get().WritePerfMap()) {
+      perror("perf map error");
+    }
+    return Opts.Eager ? compile(elab) : interpret(elab);
+  }
+
+  // Writes the program as a bytecode artifact that run loads without the
+  // front end.
+  int CompileScript(const char *output) {
+    elab::Elab elab{Terms, IDs, Table};
+    if (!check()) {
+      return -1;
+    }
+    vm::Machine machine{false};
+    auto start = timed("codegen", [&] { return assemble(machine, elab); });
+    if (!start) {
+      return -1;
+    }
+    if (!timed("write", [&] {
+          return vm::Artifact::Write(machine, *start, result(elab), output);
+        })) {
+      perror("write artifact error");
+      return -1;
+    }
+    return 0;
+  }
+
+  // Compiles the program ahead of time. The extension of output picks a shared
+  // object, object file or assembly, anything else is an executable.
+  int BuildScript(const char *output) {
+    elab::Elab elab{Terms, IDs, Table};
+    if (!check()) {
+      return -1;
+    }
+    std::string_view out{output};
+    auto ends = [out](std::string_view ext) {
+      return out.size() > ext.size() &&
+             out.substr(out.size() - ext.size()) == ext;
+    };
+    auto kind = ends(".so")  ? GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY
+                : ends(".o") ? GCC_JIT_OUTPUT_KIND_OBJECT_FILE
+                : ends(".s") ? GCC_JIT_OUTPUT_KIND_ASSEMBLER
+                             : GCC_JIT_OUTPUT_KIND_EXECUTABLE;
+
+    codegen::JIT jit{elab, Opts.Level};
+    auto built = timed("codegen", [&] {
+      for (auto &d : Defs) {
+        jit.Declare(d);
+      }
+      for (auto &d : Defs) {
+        jit.Define(d);
+      }
+      if (!jit.Build()) {
+        return false;
+      }
+      if (kind == GCC_JIT_OUTPUT_KIND_EXECUTABLE) {
+        jit.Executable(result(elab));
+      }
+      return true;
+    });
+    if (built &&
+        timed("compile", [&] { return jit.CompileTo(output, kind); })) {
+      return 0;
+    }
+    std::cout << "build error: " << jit.Error << std::endl;
+    return -1;
+  }
+
+  // Writes the report --time-passes or --stats asked for to standard error.
+  void PrintProfile() {
+    if (!profiling()) {
+      return;
+    }
+    Profile.Count("interned_terms", Table.Size());
+    Profile.Count("intern_probes", Table.Probes());
+    if (Opts.TimePasses) {
+      Profile.Print(std::cerr);
+    }
+    if (Opts.Stats) {
+      Profile.PrintJSON(std::cerr);
+    }
+  }
+
+  static int RunArtifact(const char *filename) {
+    vm::Machine machine{false};
+    std::string error{};
+    auto artifact = vm::Artifact::Load(machine, filename, error);
+    if (!artifact) {
+      std::cout << filename << ": " << error << std::endl;
+      return -1;
+    }
+    print(artifact->Result, machine.Run(*artifact->Start));
+    return 0;
+  }
+
+  // Runs the pipelines read from in, one per line with stages split by '|'
+  // and words by blanks, at most limit at once like xargs -P. What each
+  // writes is captured and printed in input order once all have run. Returns
+  // how many failed, each named on standard error with its status.
+  static int RunParallel(std::istream &in, size_t limit) {
+    shell::Scheduler scheduler{limit};
+    std::vector<std::string> jobs{};
+    for (std::string line; std::getline(in, line);) {
+      std::vector<shell::Command> cmds{{}};
+      std::string word{};
+      for (auto c : line + ' ') {
+        if (c != ' ' && c != '\t' && c != '|') {
+          word += c;
+          continue;
+        }
+        if (!word.empty()) {
+          cmds.back().push_back(std::move(word));
+          word.clear();
+        }
+        if (c == '|') {
+          cmds.emplace_back();
+        }
+      }
+      if (cmds.size() == 1 && cmds[0].empty()) {
+        continue;
+      }
+      scheduler.Add(std::move(cmds), true);
+      jobs.push_back(std::move(line));
     }
+    scheduler.Run();
+    int failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      auto &job = scheduler[i];
+      if (job.Output) {
+        std::cout << job.Output->View();
+      }
+      if (auto status = job.Status()) {
+        failed++;
+        std::cerr << jobs[i] << ": "
+                  << (job.Error.empty() ? "exit " + std::to_string(status)
+                                        : job.Error)
+                  << std::endl;
+      }
+    }
+    std::cout.flush();
+    return failed;
   }
 
-  ~Driver() {
-    int ret = fclose(Infile);
-    if (ret != 0) {
-      perror("close file error");
-      panic("close driver error");
+  static int Run(int argc, const char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "help") == 0) {
+      PrintUsage();
+      return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "version") == 0) {
+      PrintVersion();
+      return 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "serve") == 0) {
+      return Server{{argv + 2, argv + argc}}.Serve(std::cin, std::cout);
+    }
+    if (argc >= 2 && strcmp(argv[1], "parallel") == 0) {
+      auto limit = Pool::Cores();
+      for (int i = 2; i < argc; i++) {
+        char *end = nullptr;
+        if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] >= '0' &&
+            argv[i][2] <= '9') {
+          limit = strtoul(argv[i] + 2, &end, 10);
+        }
+        if (!end || *end) {
+          PrintUsage();
+          return -1;
+        }
+      }
+      return RunParallel(std::cin, limit);
+    }
+    auto run = argc >= 3 && strcmp(argv[1], "run") == 0;
+    auto compile = argc >= 3 && strcmp(argv[1], "compile") == 0;
+    auto build = argc >= 3 && strcmp(argv[1], "build") == 0;
+    if (run || compile || build) {
+      Options opts{};
+      opts.Level = build ? 2 : 0;
+      std::vector<const char *> files{};
+      const char *output = nullptr;
+      for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--packrat") == 0) {
+          opts.Packrat = true;
+        } else if (strcmp(argv[i], "--time-passes") == 0) {
+          opts.TimePasses = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+          opts.Stats = true;
+        } else if (run && strcmp(argv[i], "--no-jit") == 0) {
+          opts.NoJIT = true;
+        } else if (run && strcmp(argv[i], "--eager") == 0) {
+          opts.Eager = true;
+        } else if (run && strcmp(argv[i], "--no-cache") == 0) {
+          opts.NoCache = true;
+        } else if (run && strcmp(argv[i], "--profile") == 0) {
+          // Cached code was compiled without symbols to attribute it by.
+          opts.Sampling = opts.NoCache = true;
+        } else if (run && strcmp(argv[i], "--perf-map") == 0) {
+          opts.PerfMap = true;
+        } else if ((run || build) && strncmp(argv[i], "-O", 2) == 0 &&
+                   argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3]) {
+          opts.Level = argv[i][2] - '0';
+        } else if (!run && strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+          output = argv[++i];
+        } else {
+          files.push_back(argv[i]);
+        }
+      }
+      if (run && files.size() == 1 && vm::Artifact::Sniff(files[0])) {
+        return RunArtifact(files[0]);
+      }
+      if (run && !files.empty()) {
+        Driver driver{std::move(files), opts};
+        auto ret = driver.RunScript();
+        driver.PrintProfile();
+        return ret;
+      }
+      if (compile && !files.empty() && output) {
+        Driver driver{std::move(files), opts};
+        auto ret = driver.CompileScript(output);
+        driver.PrintProfile();
+        return ret;
+      }
+      if (build && !files.empty()) {
+        std::string out{output ? output : files[0]};
+        if (!output && out.size() > 5 &&
+            out.compare(out.size() - 5, 5, ".jian") == 0) {
+          out.resize(out.size() - 5);
+        } else if (!output) {
+          out = "a.out";
+        }
+        Driver driver{std::move(files), opts};
+        auto ret = driver.BuildScript(out.c_str());
+        driver.PrintProfile();
+        return ret;
+      }
     }
+    PrintUsage();
+    return -1;
   }
 
   static void PrintVersion() {
@@ -1447,7 +7302,39 @@ public:
               << std::endl
               << "Commands are:" << std::endl
               << std::endl
-              << "\tjian run\t\trun a script with the default JIT mode"
+              << "\tjian run\t\trun scripts with the default JIT mode"
+              << std::endl
+              << "\t\t--packrat\tmemoize parse results per input offset"
+              << std::endl
+              << "\t\t--no-jit\tonly interpret bytecode" << std::endl
+              << "\t\t--eager\t\tcompile everything before running"
+              << std::endl
+              << "\t\t--no-cache\tneither load nor store compiled code"
+              << std::endl
+              << "\t\t--time-passes\treport time and allocations per pass"
+              << std::endl
+              << "\t\t--stats\t\tthe same report as JSON" << std::endl
+              << "\t\t--profile\tsample where the program spends its time"
+              << std::endl
+              << "\t\t--perf-map\twrite compiled code to /tmp/perf-<pid>.map"
+              << std::endl
+              << "\t\t-O<level>\toptimization level of --eager, 0 to 3"
+              << std::endl
+              << "\t\tfile.jbc\trun a compiled bytecode artifact" << std::endl
+              << "\t\t-\t\trun a piped script as it arrives" << std::endl
+              << "\tjian compile\tcompile scripts to bytecode" << std::endl
+              << "\t\t-o file.jbc\twhere to write the artifact" << std::endl
+              << "\tjian build\tcompile scripts to machine code" << std::endl
+              << "\t\t-O<level>\toptimization level, 0 to 3, default 2"
+              << std::endl
+              << "\t\t-o file\t\texecutable, or .so, .o or .s file"
+              << std::endl
+              << "\tjian serve\tcheck scripts again on every line of input"
+              << std::endl
+              << "\tjian parallel\trun the pipelines on standard input, one "
+                 "per line"
+              << std::endl
+              << "\t\t-j<jobs>\thow many at once, default one per core"
               << std::endl
               << "\tjian help\tprint this usage message" << std::endl
               << "\tjian version\tprint the version" << std::endl
@@ -1455,78 +7342,9 @@ public:
   }
 };
 
-static inline void create_code(gccjit::context ctxt) {
-  gccjit::type void_type = ctxt.get_type(GCC_JIT_TYPE_VOID);
-  gccjit::type const_char_ptr_type = ctxt.get_type(GCC_JIT_TYPE_CONST_CHAR_PTR);
-  gccjit::param param_name = ctxt.new_param(const_char_ptr_type, "name");
-  std::vector<gccjit::param> func_params;
-  func_params.push_back(param_name);
-  gccjit::function func = ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED,
-                                            void_type, "greet", func_params, 0);
-
-  gccjit::param param_format = ctxt.new_param(const_char_ptr_type, "format");
-  std::vector<gccjit::param> printf_params;
-  printf_params.push_back(param_format);
-  gccjit::function printf_func = ctxt.new_function(
-      GCC_JIT_FUNCTION_IMPORTED, ctxt.get_type(GCC_JIT_TYPE_INT), "printf",
-      printf_params, 1);
-
-  gccjit::block block = func.new_block();
-  block.add_eval(
-      ctxt.new_call(printf_func, ctxt.new_rvalue("Hello, %s!\n"), param_name));
-  block.end_with_return();
-}
-
 static inline int main(int argc, const char *argv[]) {
-  (void)argc;
-  (void)argv;
-
   recovery();
-
-  /*
-  struct Driver driver;
-  if (Driver_Run(&driver, argc, argv) != 0) {
-    return 1;
-  }
-  */
-
-  gccjit::context ctxt;
-  gcc_jit_result *result;
-
-  /* Get a "context" object for working with the library.  */
-  ctxt = gccjit::context::acquire();
-
-  /* Set some options on the context.
-     Turn this on to see the code being generated, in assembler form.  */
-  ctxt.set_bool_option(GCC_JIT_BOOL_OPTION_DUMP_GENERATED_CODE, 0);
-
-  /* Populate the context.  */
-  create_code(ctxt);
-
-  /* Compile the code.  */
-  result = ctxt.compile();
-  if (!result) {
-    fprintf(stderr, "NULL result");
-    exit(1);
-  }
-
-  ctxt.release();
-
-  /* Extract the generated code from "result".  */
-  typedef void (*fn_type)(const char *);
-  auto greet =
-      reinterpret_cast<fn_type>(gcc_jit_result_get_code(result, "greet"));
-  if (!greet) {
-    fprintf(stderr, "NULL greet");
-    exit(1);
-  }
-
-  /* Now call the generated function: */
-  greet("JianScript");
-  fflush(stdout);
-
-  gcc_jit_result_release(result);
-  return 0;
+  return Driver::Run(argc, argv) == 0 ? 0 : 1;
 }
 
 } // namespace jian